@@ -0,0 +1,606 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "card_data.h"
+#include "card_index.h"
+
+/*
+ * An index of every set of track data we have ever written, so that the same
+ * contents are not encoded onto two cards.  Only a 64-bit hash of the track
+ * contents is kept, in an open-addressed table with linear probing.  A hash
+ * of 0 marks an empty slot, so no card is ever allowed to hash to 0.
+ *
+ * The on-disk snapshot is a header followed by the table itself, in host byte
+ * order, so loading it is a private mapping rather than a rebuild.  Pages are
+ * only copied out of the file when an insertion lands on them, and saving
+ * back to the same file only writes the slots that changed, so a run that
+ * adds one card costs a few pages however large the index is.  Only growing
+ * the table forces the whole snapshot to be written out again.
+ *
+ * The Bloom filter is built by scanning every slot, so it is only worth
+ * asking for when many lookups will be made against one load.
+ */
+
+#define	CARD_INDEX_MAGIC		"IDTMAGCI"
+#define	CARD_INDEX_VERSION		(1)
+#define	CARD_INDEX_MIN_CAPACITY		(1024)
+
+#define	CARD_INDEX_BLOOM_BITS_PER_SLOT	(4)
+#define	CARD_INDEX_BLOOM_HASHES		(6)
+
+struct card_index_header {
+	char cih_magic[8];
+	uint32_t cih_version;
+	uint32_t cih_reserved;
+	uint64_t cih_count;
+	uint64_t cih_capacity;
+};
+
+struct card_index {
+	uint64_t *ci_slots;
+	size_t ci_capacity;
+	size_t ci_count;
+	void *ci_map;
+	size_t ci_maplen;
+	uint64_t *ci_bloom;
+	size_t ci_bloom_bits;
+	char *ci_path;
+	size_t *ci_dirty;
+	size_t ci_ndirty;
+	size_t ci_maxdirty;
+};
+
+static void card_index_bloom_add(struct card_index *, uint64_t);
+static bool card_index_bloom_build(struct card_index *);
+static bool card_index_bloom_test(struct card_index *, uint64_t);
+static size_t card_index_capacity(size_t);
+static void card_index_dirty(struct card_index *, size_t);
+static void card_index_grow(struct card_index *);
+static uint64_t card_index_hash_track(uint64_t, unsigned, const char *, size_t);
+static bool card_index_insert(struct card_index *, uint64_t);
+static bool card_index_lookup(struct card_index *, uint64_t);
+static bool card_index_pwrite(int, const void *, size_t, off_t);
+static bool card_index_save_slots(struct card_index *, const char *, bool *);
+static bool card_index_write(int, const void *, size_t);
+
+struct card_index *
+card_index_create(size_t expected, bool bloom)
+{
+	struct card_index *ci;
+
+	ci = malloc(sizeof *ci);
+	if (ci == NULL)
+		return (NULL);
+
+	ci->ci_capacity = card_index_capacity(expected);
+	ci->ci_count = 0;
+	ci->ci_map = NULL;
+	ci->ci_maplen = 0;
+	ci->ci_bloom = NULL;
+	ci->ci_bloom_bits = 0;
+	ci->ci_path = NULL;
+	ci->ci_dirty = NULL;
+	ci->ci_ndirty = 0;
+	ci->ci_maxdirty = 0;
+
+	ci->ci_slots = calloc(ci->ci_capacity, sizeof ci->ci_slots[0]);
+	if (ci->ci_slots == NULL) {
+		free(ci);
+		return (NULL);
+	}
+
+	if (bloom && !card_index_bloom_build(ci)) {
+		card_index_free(ci);
+		return (NULL);
+	}
+
+	return (ci);
+}
+
+struct card_index *
+card_index_load(const char *path, bool bloom)
+{
+	struct card_index_header cih;
+	struct card_index *ci;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (NULL);
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return (NULL);
+	}
+
+	if ((size_t)st.st_size < sizeof cih) {
+		close(fd);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (NULL);
+
+	/*
+	 * Check that this is a snapshot we wrote, and that the table it
+	 * claims to hold is really all there.
+	 */
+	memcpy(&cih, map, sizeof cih);
+	if (memcmp(cih.cih_magic, CARD_INDEX_MAGIC, sizeof cih.cih_magic) != 0 ||
+	    cih.cih_version != CARD_INDEX_VERSION ||
+	    cih.cih_capacity < CARD_INDEX_MIN_CAPACITY ||
+	    !powerof2(cih.cih_capacity) ||
+	    cih.cih_count >= cih.cih_capacity ||
+	    (size_t)st.st_size != sizeof cih +
+	    cih.cih_capacity * sizeof ci->ci_slots[0]) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	ci = malloc(sizeof *ci);
+	if (ci == NULL) {
+		munmap(map, st.st_size);
+		return (NULL);
+	}
+
+	ci->ci_slots = (uint64_t *)((char *)map + sizeof cih);
+	ci->ci_capacity = cih.cih_capacity;
+	ci->ci_count = cih.cih_count;
+	ci->ci_map = map;
+	ci->ci_maplen = st.st_size;
+	ci->ci_bloom = NULL;
+	ci->ci_bloom_bits = 0;
+	ci->ci_path = NULL;
+	ci->ci_dirty = NULL;
+	ci->ci_ndirty = 0;
+	ci->ci_maxdirty = 0;
+
+	/*
+	 * If this fails we only lose the ability to save just the slots that
+	 * changed.
+	 */
+	ci->ci_path = strdup(path);
+
+	if (bloom && !card_index_bloom_build(ci)) {
+		card_index_free(ci);
+		return (NULL);
+	}
+
+	return (ci);
+}
+
+bool
+card_index_save(struct card_index *ci, const char *path)
+{
+	struct card_index_header cih;
+	char tmppath[MAXPATHLEN];
+	bool stale;
+	int fd;
+
+	/*
+	 * If nothing but insertions have happened since this file was loaded
+	 * or saved, only the slots they landed in need to go back.
+	 */
+	if (ci->ci_path != NULL && strcmp(ci->ci_path, path) == 0) {
+		if (card_index_save_slots(ci, path, &stale))
+			return (true);
+		if (!stale)
+			return (false);
+	}
+
+	/*
+	 * Write the snapshot beside the real one and rename it into place, so
+	 * that a crash part way through never leaves us with a truncated
+	 * index, which would be as good as no index at all.
+	 */
+	if ((size_t)snprintf(tmppath, sizeof tmppath, "%s.tmp", path) >=
+	    sizeof tmppath)
+		return (false);
+
+	memset(&cih, 0, sizeof cih);
+	memcpy(cih.cih_magic, CARD_INDEX_MAGIC, sizeof cih.cih_magic);
+	cih.cih_version = CARD_INDEX_VERSION;
+	cih.cih_count = ci->ci_count;
+	cih.cih_capacity = ci->ci_capacity;
+
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return (false);
+
+	if (!card_index_write(fd, &cih, sizeof cih) ||
+	    !card_index_write(fd, ci->ci_slots,
+			      ci->ci_capacity * sizeof ci->ci_slots[0]) ||
+	    fsync(fd) == -1) {
+		close(fd);
+		unlink(tmppath);
+		return (false);
+	}
+
+	if (close(fd) == -1) {
+		unlink(tmppath);
+		return (false);
+	}
+
+	if (rename(tmppath, path) == -1) {
+		unlink(tmppath);
+		return (false);
+	}
+
+	free(ci->ci_path);
+	ci->ci_path = strdup(path);
+	ci->ci_ndirty = 0;
+
+	return (true);
+}
+
+void
+card_index_free(struct card_index *ci)
+{
+	if (ci->ci_map != NULL)
+		munmap(ci->ci_map, ci->ci_maplen);
+	else
+		free(ci->ci_slots);
+	free(ci->ci_bloom);
+	free(ci->ci_path);
+	free(ci->ci_dirty);
+	free(ci);
+}
+
+uint64_t
+card_index_hash(const struct card_data *cdata)
+{
+	uint64_t hash;
+
+	/*
+	 * FNV-1a over each track, followed by a final mix so that the low
+	 * bits are good enough to index the table with directly.
+	 */
+	hash = 0xcbf29ce484222325ULL;
+	hash = card_index_hash_track(hash, 1, cdata->cd_track1,
+				     sizeof cdata->cd_track1 / sizeof cdata->cd_track1[0]);
+	hash = card_index_hash_track(hash, 2, cdata->cd_track2,
+				     sizeof cdata->cd_track2 / sizeof cdata->cd_track2[0]);
+	hash = card_index_hash_track(hash, 3, cdata->cd_track3,
+				     sizeof cdata->cd_track3 / sizeof cdata->cd_track3[0]);
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	if (hash == 0)
+		hash = 1;
+	return (hash);
+}
+
+size_t
+card_index_count(struct card_index *ci)
+{
+	return (ci->ci_count);
+}
+
+bool
+card_index_add(struct card_index *ci, const struct card_data *cdata)
+{
+	return (card_index_insert(ci, card_index_hash(cdata)));
+}
+
+bool
+card_index_contains(struct card_index *ci, const struct card_data *cdata)
+{
+	uint64_t hash;
+
+	hash = card_index_hash(cdata);
+
+	/*
+	 * The Bloom filter is small enough to stay in cache even when the
+	 * table is not, and it is what answers for nearly every new card.
+	 */
+	if (ci->ci_bloom != NULL && !card_index_bloom_test(ci, hash))
+		return (false);
+
+	return (card_index_lookup(ci, hash));
+}
+
+static void
+card_index_bloom_add(struct card_index *ci, uint64_t hash)
+{
+	uint64_t step;
+	size_t bit;
+	unsigned i;
+
+	step = (hash >> 32) | (hash << 32) | 1;
+	for (i = 0; i < CARD_INDEX_BLOOM_HASHES; i++) {
+		bit = (hash + i * step) & (ci->ci_bloom_bits - 1);
+		ci->ci_bloom[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+static bool
+card_index_bloom_build(struct card_index *ci)
+{
+	size_t i;
+
+	free(ci->ci_bloom);
+
+	ci->ci_bloom_bits = ci->ci_capacity * CARD_INDEX_BLOOM_BITS_PER_SLOT;
+	ci->ci_bloom = calloc(ci->ci_bloom_bits / 64, sizeof ci->ci_bloom[0]);
+	if (ci->ci_bloom == NULL) {
+		ci->ci_bloom_bits = 0;
+		return (false);
+	}
+
+	for (i = 0; i < ci->ci_capacity; i++) {
+		if (ci->ci_slots[i] != 0)
+			card_index_bloom_add(ci, ci->ci_slots[i]);
+	}
+	return (true);
+}
+
+static bool
+card_index_bloom_test(struct card_index *ci, uint64_t hash)
+{
+	uint64_t step;
+	size_t bit;
+	unsigned i;
+
+	step = (hash >> 32) | (hash << 32) | 1;
+	for (i = 0; i < CARD_INDEX_BLOOM_HASHES; i++) {
+		bit = (hash + i * step) & (ci->ci_bloom_bits - 1);
+		if ((ci->ci_bloom[bit / 64] & (1ULL << (bit % 64))) == 0)
+			return (false);
+	}
+	return (true);
+}
+
+static size_t
+card_index_capacity(size_t expected)
+{
+	size_t capacity;
+
+	/*
+	 * Keep the table at most half full.
+	 */
+	capacity = CARD_INDEX_MIN_CAPACITY;
+	while (capacity / 2 < expected)
+		capacity *= 2;
+	return (capacity);
+}
+
+static void
+card_index_dirty(struct card_index *ci, size_t slot)
+{
+	size_t *dirty;
+	size_t max;
+
+	if (ci->ci_path == NULL)
+		return;
+
+	if (ci->ci_ndirty == ci->ci_maxdirty) {
+		max = ci->ci_maxdirty == 0 ? 16 : ci->ci_maxdirty * 2;
+		dirty = realloc(ci->ci_dirty, max * sizeof dirty[0]);
+		if (dirty == NULL) {
+			/*
+			 * Fall back to writing the whole snapshot.
+			 */
+			free(ci->ci_path);
+			ci->ci_path = NULL;
+			return;
+		}
+		ci->ci_dirty = dirty;
+		ci->ci_maxdirty = max;
+	}
+	ci->ci_dirty[ci->ci_ndirty++] = slot;
+}
+
+static void
+card_index_grow(struct card_index *ci)
+{
+	uint64_t *oslots;
+	size_t ocapacity;
+	size_t i;
+
+	oslots = ci->ci_slots;
+	ocapacity = ci->ci_capacity;
+
+	/*
+	 * Every slot moves, so the next save has to write all of them.
+	 */
+	free(ci->ci_path);
+	ci->ci_path = NULL;
+	ci->ci_ndirty = 0;
+
+	ci->ci_capacity = ocapacity * 2;
+	ci->ci_slots = calloc(ci->ci_capacity, sizeof ci->ci_slots[0]);
+	if (ci->ci_slots == NULL)
+		abort();
+	ci->ci_count = 0;
+
+	for (i = 0; i < ocapacity; i++) {
+		if (oslots[i] != 0)
+			card_index_insert(ci, oslots[i]);
+	}
+
+	if (ci->ci_map != NULL) {
+		munmap(ci->ci_map, ci->ci_maplen);
+		ci->ci_map = NULL;
+		ci->ci_maplen = 0;
+	} else {
+		free(oslots);
+	}
+
+	if (ci->ci_bloom != NULL && !card_index_bloom_build(ci))
+		abort();
+}
+
+static uint64_t
+card_index_hash_track(uint64_t hash, unsigned track, const char *trackdata, size_t len)
+{
+	size_t i;
+
+	/*
+	 * Note that we are requiring the trackdata to be ASCII NUL terminated
+	 * if it does not use the complete field, as on write.  The track
+	 * number goes in first so that data cannot shift between tracks and
+	 * still hash the same.
+	 */
+	if (memchr(trackdata, '\0', len) != NULL)
+		len = strlen(trackdata);
+
+	hash ^= track;
+	hash *= 0x100000001b3ULL;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)trackdata[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return (hash);
+}
+
+static bool
+card_index_insert(struct card_index *ci, uint64_t hash)
+{
+	size_t slot;
+
+	if ((ci->ci_count + 1) * 2 > ci->ci_capacity)
+		card_index_grow(ci);
+
+	for (slot = hash & (ci->ci_capacity - 1);;
+	     slot = (slot + 1) & (ci->ci_capacity - 1)) {
+		if (ci->ci_slots[slot] == hash)
+			return (false);
+		if (ci->ci_slots[slot] == 0)
+			break;
+	}
+
+	ci->ci_slots[slot] = hash;
+	ci->ci_count++;
+	card_index_dirty(ci, slot);
+	if (ci->ci_bloom != NULL)
+		card_index_bloom_add(ci, hash);
+	return (true);
+}
+
+static bool
+card_index_lookup(struct card_index *ci, uint64_t hash)
+{
+	size_t slot;
+
+	for (slot = hash & (ci->ci_capacity - 1);;
+	     slot = (slot + 1) & (ci->ci_capacity - 1)) {
+		if (ci->ci_slots[slot] == hash)
+			return (true);
+		if (ci->ci_slots[slot] == 0)
+			return (false);
+	}
+}
+
+static bool
+card_index_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p;
+	ssize_t rv;
+
+	for (p = buf; len != 0; p += rv, len -= rv, off += rv) {
+		rv = pwrite(fd, p, len, off);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static bool
+card_index_save_slots(struct card_index *ci, const char *path, bool *stale)
+{
+	struct card_index_header cih;
+	size_t i, slot;
+	int fd;
+
+	*stale = false;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		*stale = errno == ENOENT;
+		return (false);
+	}
+
+	/*
+	 * Make sure the file is still the table we think it is, in case it
+	 * has been replaced underneath us; if not, write it out whole.
+	 */
+	if (pread(fd, &cih, sizeof cih, 0) != (ssize_t)sizeof cih ||
+	    memcmp(cih.cih_magic, CARD_INDEX_MAGIC, sizeof cih.cih_magic) != 0 ||
+	    cih.cih_version != CARD_INDEX_VERSION ||
+	    cih.cih_capacity != ci->ci_capacity) {
+		close(fd);
+		*stale = true;
+		return (false);
+	}
+
+	/*
+	 * Each slot is a single aligned word, and a count that runs ahead of
+	 * the slots after a crash only makes the table grow a little early.
+	 */
+	for (i = 0; i < ci->ci_ndirty; i++) {
+		slot = ci->ci_dirty[i];
+		if (!card_index_pwrite(fd, &ci->ci_slots[slot],
+				       sizeof ci->ci_slots[slot],
+				       sizeof cih + slot * sizeof ci->ci_slots[0])) {
+			close(fd);
+			return (false);
+		}
+	}
+
+	cih.cih_count = ci->ci_count;
+	if (!card_index_pwrite(fd, &cih, sizeof cih, 0) || fsync(fd) == -1) {
+		close(fd);
+		return (false);
+	}
+
+	if (close(fd) == -1)
+		return (false);
+
+	ci->ci_ndirty = 0;
+	return (true);
+}
+
+static bool
+card_index_write(int fd, const void *buf, size_t len)
+{
+	const char *p;
+	ssize_t rv;
+
+	for (p = buf; len != 0; p += rv, len -= rv) {
+		rv = write(fd, p, len);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+			return (false);
+		}
+	}
+	return (true);
+}
@@ -0,0 +1,18 @@
+#ifndef	CARD_INDEX_H
+#define	CARD_INDEX_H
+
+struct card_data;
+struct card_index;
+
+struct card_index *card_index_create(size_t, bool);
+struct card_index *card_index_load(const char *, bool);
+bool card_index_save(struct card_index *, const char *);
+void card_index_free(struct card_index *);
+
+uint64_t card_index_hash(const struct card_data *);
+size_t card_index_count(struct card_index *);
+
+bool card_index_add(struct card_index *, const struct card_data *);
+bool card_index_contains(struct card_index *, const struct card_data *);
+
+#endif /* !CARD_INDEX_H */
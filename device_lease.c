@@ -0,0 +1,320 @@
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef	__linux__
+#include <sys/inotify.h>
+#endif
+
+#include "device_lease.h"
+
+/*
+ * Leases on devices shared between processes.  Each device has a lock file in
+ * a common directory, and holding the lease means holding an exclusive flock
+ * on it.  The kernel drops the lock when the holder closes the file or exits
+ * for any reason, so a crashed holder never leaves a device stuck, and anyone
+ * blocked waiting for that device is woken straight away.
+ *
+ * Waiting for whichever device comes free first cannot be done with flock
+ * alone.  Instead we watch the lock directory: a holder has its lock file
+ * open for writing, so its release shows up as a close-after-write event,
+ * whether it gave the lease up or died.  Waiters keep their own lock files
+ * open the whole time they wait, so that they do not wake each other up.
+ */
+
+#define	DEVICE_LEASE_DEVICE_DIRECTORY	"/dev/"
+#define	DEVICE_LEASE_RETRY_INTERVAL	(250000)	/* Microseconds.  */
+
+struct device_lease {
+	int dl_fd;
+	char dl_device[];
+};
+
+static struct device_lease *device_lease_create(int, const char *);
+static int device_lease_open(const char *, const char *);
+static bool device_lease_path(const char *, const char *, char *, size_t);
+static void device_lease_stamp(int);
+
+struct device_lease *
+device_lease_acquire(const char *dir, const char *device, bool wait)
+{
+	struct device_lease *dl;
+	int error;
+	int fd;
+
+	fd = device_lease_open(dir, device);
+	if (fd == -1)
+		return (NULL);
+
+	while (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) == -1) {
+		if (errno == EINTR)
+			continue;
+		error = errno;
+		close(fd);
+		errno = error;
+		return (NULL);
+	}
+
+	dl = device_lease_create(fd, device);
+	if (dl == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	return (dl);
+}
+
+struct device_lease *
+device_lease_acquire_any(const char *dir, const char *const *devices, size_t ndevices, bool wait)
+{
+	struct device_lease *dl;
+	int *fds;
+	size_t i, j;
+	int error;
+	int watch;
+
+	if (ndevices == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	watch = -1;
+#ifdef	__linux__
+	/*
+	 * Watch before the first attempt, so that a release in between is
+	 * not missed.
+	 */
+	if (wait) {
+		watch = inotify_init1(IN_CLOEXEC);
+		if (watch == -1)
+			return (NULL);
+		if (inotify_add_watch(watch, dir, IN_CLOSE_WRITE) == -1) {
+			error = errno;
+			close(watch);
+			errno = error;
+			return (NULL);
+		}
+	}
+#endif
+
+	fds = malloc(ndevices * sizeof fds[0]);
+	if (fds == NULL) {
+		if (watch != -1)
+			close(watch);
+		return (NULL);
+	}
+
+	for (i = 0; i < ndevices; i++) {
+		fds[i] = device_lease_open(dir, devices[i]);
+		if (fds[i] == -1) {
+			error = errno;
+			while (i-- != 0)
+				close(fds[i]);
+			free(fds);
+			if (watch != -1)
+				close(watch);
+			errno = error;
+			return (NULL);
+		}
+	}
+
+	for (;;) {
+		for (i = 0; i < ndevices; i++) {
+			if (flock(fds[i], LOCK_EX | LOCK_NB) == 0)
+				break;
+		}
+		if (i != ndevices)
+			break;
+
+		if (!wait) {
+			error = EWOULDBLOCK;
+			goto fail;
+		}
+
+#ifdef	__linux__
+		{
+			char buf[4096];
+
+			/*
+			 * We do not care which file it was: any close may be a
+			 * release, and it is cheaper to try them all again
+			 * than to work out which device each name belongs to.
+			 */
+			if (read(watch, buf, sizeof buf) == -1 && errno != EINTR) {
+				error = errno;
+				goto fail;
+			}
+		}
+#else
+		/*
+		 * Without a way to be told about releases, all we can do is
+		 * try again in a little while.
+		 */
+		usleep(DEVICE_LEASE_RETRY_INTERVAL);
+#endif
+	}
+
+	for (j = 0; j < ndevices; j++) {
+		if (j != i)
+			close(fds[j]);
+	}
+	if (watch != -1)
+		close(watch);
+
+	dl = device_lease_create(fds[i], devices[i]);
+	if (dl == NULL)
+		close(fds[i]);
+	free(fds);
+	return (dl);
+
+fail:
+	for (j = 0; j < ndevices; j++)
+		close(fds[j]);
+	free(fds);
+	if (watch != -1)
+		close(watch);
+	errno = error;
+	return (NULL);
+}
+
+void
+device_lease_release(struct device_lease *dl)
+{
+	/*
+	 * Closing the file is what drops the lock, and what wakes anyone
+	 * waiting for any device.  The lock file itself stays, since someone
+	 * may already have it open to wait on.
+	 */
+	close(dl->dl_fd);
+	free(dl);
+}
+
+const char *
+device_lease_device(struct device_lease *dl)
+{
+	return (dl->dl_device);
+}
+
+pid_t
+device_lease_holder(const char *dir, const char *device)
+{
+	char path[MAXPATHLEN];
+	char buf[32];
+	ssize_t rv;
+	pid_t pid;
+	int fd;
+
+	if (!device_lease_path(dir, device, path, sizeof path))
+		return (-1);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (errno == ENOENT ? 0 : -1);
+
+	/*
+	 * If we can get a shared lock, nobody holds the lease, whatever pid
+	 * was last written to the file.
+	 */
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0) {
+		close(fd);
+		return (0);
+	}
+
+	rv = pread(fd, buf, sizeof buf - 1, 0);
+	close(fd);
+	if (rv <= 0)
+		return (-1);
+	buf[rv] = '\0';
+
+	pid = strtol(buf, NULL, 10);
+	return (pid > 0 ? pid : -1);
+}
+
+static struct device_lease *
+device_lease_create(int fd, const char *device)
+{
+	struct device_lease *dl;
+	size_t len;
+
+	len = strlen(device) + 1;
+	dl = malloc(sizeof *dl + len);
+	if (dl == NULL)
+		return (NULL);
+
+	dl->dl_fd = fd;
+	memcpy(dl->dl_device, device, len);
+	device_lease_stamp(fd);
+	return (dl);
+}
+
+static int
+device_lease_open(const char *dir, const char *device)
+{
+	char path[MAXPATHLEN];
+
+	if (!device_lease_path(dir, device, path, sizeof path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	/*
+	 * Opened for writing even by waiters, since that is what makes the
+	 * eventual close visible to the directory watch.
+	 */
+	return (open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666));
+}
+
+static bool
+device_lease_path(const char *dir, const char *device, char *path, size_t len)
+{
+	char real[MAXPATHLEN];
+	size_t dirlen, i;
+
+	/*
+	 * The same device may be named with or without the /dev prefix, or
+	 * through a symlink such as one under /dev/serial, and every one of
+	 * those has to come to the same lock file.  Resolve a path to the
+	 * device node itself, and then name it as it appears under /dev.
+	 */
+	if (strchr(device, '/') != NULL) {
+		if (realpath(device, real) != NULL)
+			device = real;
+		if (strncmp(device, DEVICE_LEASE_DEVICE_DIRECTORY,
+			    sizeof DEVICE_LEASE_DEVICE_DIRECTORY - 1) == 0)
+			device += sizeof DEVICE_LEASE_DEVICE_DIRECTORY - 1;
+	}
+
+	if ((size_t)snprintf(path, len, "%s/%s.lock", dir, device) >= len)
+		return (false);
+
+	/*
+	 * Anything else given by full path is flattened into one name.
+	 */
+	dirlen = strlen(dir) + 1;
+	for (i = dirlen; path[i] != '\0'; i++) {
+		if (path[i] == '/')
+			path[i] = '_';
+	}
+	return (true);
+}
+
+static void
+device_lease_stamp(int fd)
+{
+	char buf[32];
+	int len;
+
+	/*
+	 * Record who holds the lease, for device_lease_holder.  This is only
+	 * informational; the lock is what counts.
+	 */
+	len = snprintf(buf, sizeof buf, "%ld\n", (long)getpid());
+	if (ftruncate(fd, 0) == 0)
+		(void)pwrite(fd, buf, len, 0);
+}
@@ -0,0 +1,13 @@
+#ifndef	DEVICE_LEASE_H
+#define	DEVICE_LEASE_H
+
+struct device_lease;
+
+struct device_lease *device_lease_acquire(const char *, const char *, bool);
+struct device_lease *device_lease_acquire_any(const char *, const char *const *, size_t, bool);
+void device_lease_release(struct device_lease *);
+
+const char *device_lease_device(struct device_lease *);
+pid_t device_lease_holder(const char *, const char *);
+
+#endif /* !DEVICE_LEASE_H */
@@ -1,5 +1,10 @@
 #include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -9,70 +14,230 @@
 
 #define	EZ_WRITER_ESCAPE	'\x1b'
 
-static const char ez_writer_coercivity_high_string[] = {
-	EZ_WRITER_ESCAPE,
-	'x'
+#define	EZ_WRITER_COMMAND_TIMEOUT	(5000)	/* Milliseconds.  */
+#define	EZ_WRITER_SPEED_PROBE_TIMEOUT	(250)	/* Milliseconds.  */
+
+/*
+ * Everything we say to the device, and what it should say back.
+ *
+ * A command is sent as its bytes followed by an argument of ewc_arglen bytes,
+ * if it takes one.  For a command with a data block, the block comes next,
+ * sent or received by the caller, and then the response.  A response with a
+ * status is an escape and a status byte which must be ewc_status; anything
+ * else is just data.  Commands which wait for a card to be swiped wait as
+ * long as it takes, while everything else has to be answered promptly.  The
+ * name is what the command is called in metrics and the like.
+ */
+struct ez_writer_command {
+	const char *ewc_name;
+	int ewc_stage;
+	char ewc_bytes[2];
+	size_t ewc_len;
+	size_t ewc_arglen;
+	bool ewc_block;
+	size_t ewc_response;
+	char ewc_status;
+	bool ewc_swipe;
+	unsigned ewc_timeout;		/* Milliseconds, if not the default.  */
+	unsigned long ewc_delay;	/* Microseconds to wait after sending.  */
 };
 
-static const char ez_writer_coercivity_low_string[] = {
-	EZ_WRITER_ESCAPE,
-	'y'
-};
-
-static const char ez_writer_erase_string[] = {
-	EZ_WRITER_ESCAPE,
-	'c'
-};
-
-static const char ez_writer_present_string[] = {
-	'9'
-};
-
-static const char ez_writer_ram_test_string[] = {
-	EZ_WRITER_ESCAPE,
-	'\x87'
-};
-
-static const char ez_writer_read_ascii_string[] = {
-	EZ_WRITER_ESCAPE,
-	'r'
+#define	EZ_WRITER_COMMAND_PRESENT		(0)
+#define	EZ_WRITER_COMMAND_PROBE			(1)
+#define	EZ_WRITER_COMMAND_RESET_BUFFER		(2)
+#define	EZ_WRITER_COMMAND_TEST			(3)
+#define	EZ_WRITER_COMMAND_RAM_TEST		(4)
+#define	EZ_WRITER_COMMAND_VERSION		(5)
+#define	EZ_WRITER_COMMAND_COERCIVITY_HIGH	(6)
+#define	EZ_WRITER_COMMAND_COERCIVITY_LOW	(7)
+#define	EZ_WRITER_COMMAND_READ			(8)
+#define	EZ_WRITER_COMMAND_WRITE			(9)
+#define	EZ_WRITER_COMMAND_ERASE			(10)
+
+static const struct ez_writer_command ez_writer_commands[] = {
+	[EZ_WRITER_COMMAND_PRESENT] = {
+		.ewc_name = "present",
+		.ewc_stage = EZ_WRITER_STAGE_PRESENT,
+		.ewc_bytes = { '9' },
+		.ewc_len = 1,
+		.ewc_response = 2,
+		.ewc_status = '4',
+	},
+	/*
+	 * The same, but at a rate the device may not be listening at, so
+	 * give up quickly.
+	 */
+	[EZ_WRITER_COMMAND_PROBE] = {
+		.ewc_name = "negotiate",
+		.ewc_stage = EZ_WRITER_STAGE_NEGOTIATE,
+		.ewc_bytes = { '9' },
+		.ewc_len = 1,
+		.ewc_response = 2,
+		.ewc_status = '4',
+		.ewc_timeout = EZ_WRITER_SPEED_PROBE_TIMEOUT,
+	},
+	/*
+	 * No response, but the device needs a moment.
+	 */
+	[EZ_WRITER_COMMAND_RESET_BUFFER] = {
+		.ewc_name = "reset_buffer",
+		.ewc_stage = EZ_WRITER_STAGE_RESET_BUFFER,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'a' },
+		.ewc_len = 2,
+		.ewc_delay = 1000000,
+	},
+	[EZ_WRITER_COMMAND_TEST] = {
+		.ewc_name = "test",
+		.ewc_stage = EZ_WRITER_STAGE_TEST,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'e' },
+		.ewc_len = 2,
+		.ewc_response = 2,
+		.ewc_status = 'y',
+	},
+	[EZ_WRITER_COMMAND_RAM_TEST] = {
+		.ewc_name = "ram_test",
+		.ewc_stage = EZ_WRITER_STAGE_RAM_TEST,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, '\x87' },
+		.ewc_len = 2,
+		.ewc_response = 2,
+		.ewc_status = '0',
+	},
+	[EZ_WRITER_COMMAND_VERSION] = {
+		.ewc_name = "version",
+		.ewc_stage = EZ_WRITER_STAGE_VERSION,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'u' },
+		.ewc_len = 2,
+		.ewc_response = EZ_WRITER_VERSION_LENGTH,
+	},
+	[EZ_WRITER_COMMAND_COERCIVITY_HIGH] = {
+		.ewc_name = "coercivity",
+		.ewc_stage = EZ_WRITER_STAGE_COERCIVITY,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'x' },
+		.ewc_len = 2,
+		.ewc_response = 2,
+		.ewc_status = '0',
+	},
+	[EZ_WRITER_COMMAND_COERCIVITY_LOW] = {
+		.ewc_name = "coercivity",
+		.ewc_stage = EZ_WRITER_STAGE_COERCIVITY,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'y' },
+		.ewc_len = 2,
+		.ewc_response = 2,
+		.ewc_status = '0',
+	},
+	[EZ_WRITER_COMMAND_READ] = {
+		.ewc_name = "read",
+		.ewc_stage = EZ_WRITER_STAGE_READ,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'r' },
+		.ewc_len = 2,
+		.ewc_block = true,
+		.ewc_response = 2,
+		.ewc_status = '0',
+		.ewc_swipe = true,
+	},
+	[EZ_WRITER_COMMAND_WRITE] = {
+		.ewc_name = "write",
+		.ewc_stage = EZ_WRITER_STAGE_WRITE,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'w' },
+		.ewc_len = 2,
+		.ewc_block = true,
+		.ewc_response = 2,
+		.ewc_status = '0',
+		.ewc_swipe = true,
+	},
+	/*
+	 * The argument is the mask of tracks to erase.
+	 */
+	[EZ_WRITER_COMMAND_ERASE] = {
+		.ewc_name = "erase",
+		.ewc_stage = EZ_WRITER_STAGE_ERASE,
+		.ewc_bytes = { EZ_WRITER_ESCAPE, 'c' },
+		.ewc_len = 2,
+		.ewc_arglen = 1,
+		.ewc_response = 2,
+		.ewc_status = '0',
+		.ewc_swipe = true,
+	},
 };
 
-static const char ez_writer_reset_buffer_string[] = {
-	EZ_WRITER_ESCAPE,
-	'a'
+/*
+ * Rates to try when negotiating, fastest first.  The last is what the device
+ * comes up at, so it is what we are left with if nothing answers.
+ */
+static const unsigned ez_writer_speeds[] = {
+	115200,
+	57600,
+	38400,
+	19200,
+	9600,
 };
 
-static const char ez_writer_test_string[] = {
-	EZ_WRITER_ESCAPE,
-	'e'
-};
+#define	EZ_WRITER_SPEED_CACHE_SIZE	(16)
+#define	EZ_WRITER_SPEED_IDENTITY_LENGTH	(160)
 
-static const char ez_writer_version_string[] = {
-	EZ_WRITER_ESCAPE,
-	'u'
-};
+#define	EZ_WRITER_STOCK_CONFIDENT	(16)	/* Verified writes in a row.  */
+#define	EZ_WRITER_STOCK_SAMPLE		(16)	/* Then verify one in this many.  */
 
-static const char ez_writer_write_ascii_string[] = {
-	EZ_WRITER_ESCAPE,
-	'w'
-};
+/*
+ * The rate each device we have negotiated with answered at, so that the next
+ * time it is opened we can go straight to it.
+ */
+static struct ez_writer_speed_cache {
+	char ewsc_identity[EZ_WRITER_SPEED_IDENTITY_LENGTH];
+	unsigned ewsc_speed;
+} ez_writer_speed_cache[EZ_WRITER_SPEED_CACHE_SIZE];
+static unsigned ez_writer_speed_cache_next;
+static pthread_mutex_t ez_writer_speed_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #define	EZ_WRITER_READ(sport, buf)					\
 	serial_port_read(sport, buf, sizeof buf / sizeof buf[0])
 
-#define	EZ_WRITER_WRITE(sport, buf)					\
-	serial_port_write(sport, buf, sizeof buf / sizeof buf[0])
-
+static bool ez_writer_coercivity_locked(struct serial_port *, bool);
+static bool ez_writer_command(struct serial_port *, unsigned, const char *, char *);
+static bool ez_writer_command_response(struct serial_port *, unsigned, char *);
+static unsigned ez_writer_delta(unsigned, const struct card_data *, const struct card_data *);
+static size_t ez_writer_encode_track(char *, unsigned, const char *, size_t);
+static bool ez_writer_erase_auto_locked(struct serial_port *, struct ez_writer_stock *, unsigned);
+static bool ez_writer_erase_locked(struct serial_port *, unsigned);
+static bool ez_writer_fail(struct serial_port *, int, int);
+static bool ez_writer_initialize_locked(struct serial_port *);
+static bool ez_writer_negotiate_speed_locked(struct serial_port *, const char *);
 static bool ez_writer_present(struct serial_port *);
+static bool ez_writer_probe(struct serial_port *);
 static bool ez_writer_ram_test(struct serial_port *);
+static bool ez_writer_read_locked(struct serial_port *, struct card_data *);
 static bool ez_writer_read_track(struct serial_port *, char *, char *);
+static bool ez_writer_recover_locked(struct serial_port *);
 static bool ez_writer_reset_buffer(struct serial_port *);
+static unsigned ez_writer_speed_lookup(const char *);
+static void ez_writer_speed_store(const char *, unsigned);
+static void ez_writer_stage(struct serial_port *, int);
+static bool ez_writer_status(struct serial_port *, const char *, char);
 static bool ez_writer_test(struct serial_port *);
-static bool ez_writer_write_track(struct serial_port *, unsigned, const char *, size_t);
+static const char *ez_writer_track_data(const struct card_data *, unsigned, size_t *);
+static bool ez_writer_verify(unsigned, const struct card_data *, const struct card_data *);
+static bool ez_writer_version_locked(struct serial_port *, char *, size_t);
+static bool ez_writer_write_auto_locked(struct serial_port *, struct ez_writer_stock *,
+					unsigned, const struct card_data *,
+					const struct card_data *);
+static bool ez_writer_write_frame_locked(struct serial_port *, const char *, size_t);
+static bool ez_writer_write_tracks_locked(struct serial_port *, bool, unsigned,
+					  const struct card_data *,
+					  const struct card_data *);
 
 bool
 ez_writer_initialize(struct serial_port *sport)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_initialize_locked(sport);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_initialize_locked(struct serial_port *sport)
 {
 	if (!ez_writer_present(sport))
 		return (false);
@@ -92,50 +257,202 @@ ez_writer_initialize(struct serial_port *sport)
 	return (true);
 }
 
+bool
+ez_writer_coercivity(struct serial_port *sport, bool hico)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_coercivity_locked(sport, hico);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_coercivity_locked(struct serial_port *sport, bool hico)
+{
+	return (ez_writer_command(sport, hico ?
+				  EZ_WRITER_COMMAND_COERCIVITY_HIGH :
+				  EZ_WRITER_COMMAND_COERCIVITY_LOW, NULL, NULL));
+}
+
+size_t
+ez_writer_encode_write(char *frame, size_t framelen, unsigned mask, const struct card_data *cdata)
+{
+	static const char data_block_begin[] = {
+		EZ_WRITER_ESCAPE, 's'
+	};
+	static const char data_block_end[] = {
+		'?', '\x1c'
+	};
+	const char *trackdata;
+	size_t len, off;
+	unsigned track;
+
+	if ((mask & ~EZ_WRITER_TRACK_MASK) != 0)
+		return (0);
+
+	/*
+	 * The whole write command, so that it goes out in one piece.
+	 */
+	off = 0;
+	memcpy(frame + off, ez_writer_commands[EZ_WRITER_COMMAND_WRITE].ewc_bytes,
+	       ez_writer_commands[EZ_WRITER_COMMAND_WRITE].ewc_len);
+	off += ez_writer_commands[EZ_WRITER_COMMAND_WRITE].ewc_len;
+	memcpy(frame + off, data_block_begin, sizeof data_block_begin);
+	off += sizeof data_block_begin;
+
+	/*
+	 * Tracks left out of the data block are left alone by the device.  A
+	 * selected track with no data is sent empty; whether that blanks it
+	 * has not been checked on a device, so erase explicitly if it matters.
+	 */
+	for (track = 1; track <= 3; track++) {
+		if ((mask & EZ_WRITER_TRACK_TO_BITMASK(track)) == 0)
+			continue;
+		trackdata = ez_writer_track_data(cdata, track, &len);
+		if (off + 2 + len + sizeof data_block_end > framelen)
+			return (0);
+		off += ez_writer_encode_track(frame + off, track, trackdata,
+					      len);
+	}
+
+	memcpy(frame + off, data_block_end, sizeof data_block_end);
+	off += sizeof data_block_end;
+	return (off);
+}
+
 bool
 ez_writer_erase(struct serial_port *sport, unsigned mask)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_erase_locked(sport, mask);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_erase_locked(struct serial_port *sport, unsigned mask)
 {
 	char erase_ports[1];
-	char erase_response[2];
+
+	ez_writer_stage(sport, EZ_WRITER_STAGE_ERASE);
 
 	/*
 	 * We only have three tracks.  If the user thinks otherwise, they
 	 * are a fool.
 	 */
-	if ((mask & ~(EZ_WRITER_TRACK_TO_BITMASK(1) |
-		      EZ_WRITER_TRACK_TO_BITMASK(2) |
-		      EZ_WRITER_TRACK_TO_BITMASK(3))) != 0)
-		return (false);
+	if ((mask & ~EZ_WRITER_TRACK_MASK) != 0)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_ARGUMENT, -1));
 	/*
 	 * What could we possibly do to no tracks?
 	 */
 	if (mask == 0)
-		return (false);
-
-	if (!EZ_WRITER_WRITE(sport, ez_writer_erase_string))
-		return (false);
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_ARGUMENT, -1));
 
 	erase_ports[0] = mask;
 
-	if (!EZ_WRITER_WRITE(sport, erase_ports))
-		return (false);
+	return (ez_writer_command(sport, EZ_WRITER_COMMAND_ERASE, erase_ports,
+				  NULL));
+}
 
-	if (!EZ_WRITER_READ(sport, erase_response))
-		return (false);
+bool
+ez_writer_erase_auto(struct serial_port *sport, struct ez_writer_stock *ews, unsigned mask)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_erase_auto_locked(sport, ews, mask);
+	serial_port_unlock(sport);
+	return (ok);
+}
 
-	if (erase_response[0] != EZ_WRITER_ESCAPE || erase_response[1] != '0')
+static bool
+ez_writer_erase_auto_locked(struct serial_port *sport, struct ez_writer_stock *ews, unsigned mask)
+{
+	/*
+	 * Erase with whatever the stock has been writing best with, on the
+	 * theory that a field which is too weak to write a card is also too
+	 * weak to wipe it.  Whether the device pays any attention to the
+	 * setting when erasing has not been checked; see TODO.
+	 */
+	if (!ez_writer_coercivity_locked(sport, ez_writer_stock_hico(ews)))
 		return (false);
-	return (true);
+	return (ez_writer_erase_locked(sport, mask));
+}
+
+bool
+ez_writer_negotiate_speed(struct serial_port *sport, const char *identity)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_negotiate_speed_locked(sport, identity);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_negotiate_speed_locked(struct serial_port *sport, const char *identity)
+{
+	struct serial_port_config config;
+	unsigned speed;
+	unsigned i;
+
+	config = sport->sp_config;
+
+	if (identity != NULL) {
+		speed = ez_writer_speed_lookup(identity);
+		if (speed != 0) {
+			config.spc_speed = speed;
+			if (serial_port_configure(sport, &config) &&
+			    ez_writer_probe(sport))
+				return (true);
+		}
+	}
+
+	for (i = 0; i < sizeof ez_writer_speeds / sizeof ez_writer_speeds[0]; i++) {
+		config.spc_speed = ez_writer_speeds[i];
+
+		/*
+		 * Not every host can do every rate.
+		 */
+		if (!serial_port_configure(sport, &config))
+			continue;
+
+		if (!ez_writer_probe(sport))
+			continue;
+
+		if (identity != NULL)
+			ez_writer_speed_store(identity, config.spc_speed);
+		return (true);
+	}
+	return (false);
 }
 
 bool
 ez_writer_read(struct serial_port *sport, struct card_data *cdata)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_read_locked(sport, cdata);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_read_locked(struct serial_port *sport, struct card_data *cdata)
 {
 	char tuple[2];
 
+	ez_writer_stage(sport, EZ_WRITER_STAGE_READ);
+
 	memset(cdata, '\0', sizeof *cdata);
 
-	if (!EZ_WRITER_WRITE(sport, ez_writer_read_ascii_string))
+	if (!ez_writer_command(sport, EZ_WRITER_COMMAND_READ, NULL, NULL))
 		return (false);
 
 	/*
@@ -145,7 +462,7 @@ ez_writer_read(struct serial_port *sport, struct card_data *cdata)
 		return (false);
 
 	if (tuple[0] != EZ_WRITER_ESCAPE || tuple[1] != 's')
-		return (false);
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_FRAMING, -1));
 
 	if (!EZ_WRITER_READ(sport, tuple))
 		return (false);
@@ -173,47 +490,225 @@ ez_writer_read(struct serial_port *sport, struct card_data *cdata)
 					return (false);
 				break;
 			default:
-				return (false);
+				return (ez_writer_fail(sport,
+						       SERIAL_PORT_FAULT_FRAMING,
+						       -1));
 			}
 			break;
 		case '?':
 			if (tuple[1] != '\x1c')
-				return (false);
+				return (ez_writer_fail(sport,
+						       SERIAL_PORT_FAULT_FRAMING,
+						       -1));
 
-			/*
-			 * Read status tuple.
-			 */
-			if (!EZ_WRITER_READ(sport, tuple))
-				return (false);
-			switch (tuple[0]) {
-			case EZ_WRITER_ESCAPE:
-				switch (tuple[1]) {
-				case '0':
-					return (true);
-				default:
-					return (false);
-				}
-			default:
-				return (false);
-			}
+			return (ez_writer_command_response(sport,
+							   EZ_WRITER_COMMAND_READ,
+							   NULL));
 		default:
-			return (false);
+			return (ez_writer_fail(sport, SERIAL_PORT_FAULT_FRAMING,
+					       -1));
 		}
 	}
 }
 
 bool
-ez_writer_version(struct serial_port *sport, char *buf, size_t len)
+ez_writer_recover(struct serial_port *sport)
 {
-	char version_response[EZ_WRITER_VERSION_LENGTH];
+	bool ok;
 
-	if (len != EZ_WRITER_VERSION_LENGTH + 1)
+	serial_port_lock(sport);
+	ok = ez_writer_recover_locked(sport);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_recover_locked(struct serial_port *sport)
+{
+	struct serial_port_error error;
+
+	error = sport->sp_error;
+
+	/*
+	 * Work up from the cheapest thing which could possibly get us back to
+	 * a known state.  If we were turned away before anything was sent,
+	 * there is nothing to do at all.
+	 */
+	switch (error.spe_fault) {
+	case SERIAL_PORT_FAULT_NONE:
+	case SERIAL_PORT_FAULT_ARGUMENT:
+		if (error.spe_sync)
+			return (true);
+		break;
+	case SERIAL_PORT_FAULT_STATUS:
+		/*
+		 * The device said no, but the whole response was read, so we
+		 * are still at a command boundary.  Clear out whatever it was
+		 * holding on to.
+		 */
+		if (error.spe_sync && ez_writer_reset_buffer(sport))
+			return (true);
+		break;
+	default:
+		break;
+	}
+
+	/*
+	 * We do not know where we are in the byte stream.  Abort whatever the
+	 * device thinks it is doing, discard anything it sent meanwhile, and
+	 * make sure that it is talking to us again.
+	 */
+	if (ez_writer_reset_buffer(sport) && serial_port_flush(sport) &&
+	    ez_writer_present(sport))
+		return (true);
+
+	/*
+	 * Last resort.
+	 */
+	if (!serial_port_flush(sport))
+		return (false);
+	return (ez_writer_initialize_locked(sport));
+}
+
+/*
+ * The speed cache only lasts as long as the process, which for a one-shot
+ * tool is no time at all, so it can be kept in a file between runs.  Each
+ * line is a speed and the identity it goes with.
+ */
+bool
+ez_writer_speed_cache_load(const char *path)
+{
+	char line[EZ_WRITER_SPEED_IDENTITY_LENGTH + 16];
+	unsigned long speed;
+	char *identity;
+	size_t len;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (file == NULL)
 		return (false);
 
-	if (!EZ_WRITER_WRITE(sport, ez_writer_version_string))
+	while (fgets(line, sizeof line, file) != NULL) {
+		len = strlen(line);
+		if (len != 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		speed = strtoul(line, &identity, 10);
+		if (identity == line || *identity != ' ' || speed == 0)
+			continue;
+		identity++;
+		if (*identity == '\0')
+			continue;
+		ez_writer_speed_store(identity, speed);
+	}
+	fclose(file);
+	return (true);
+}
+
+bool
+ez_writer_speed_cache_save(const char *path)
+{
+	char tmppath[MAXPATHLEN];
+	struct ez_writer_speed_cache *ewsc;
+	FILE *file;
+	unsigned i;
+	int error;
+
+	if ((size_t)snprintf(tmppath, sizeof tmppath, "%s.tmp", path) >=
+	    sizeof tmppath) {
+		errno = ENAMETOOLONG;
 		return (false);
+	}
 
-	if (!EZ_WRITER_READ(sport, version_response))
+	file = fopen(tmppath, "w");
+	if (file == NULL)
+		return (false);
+
+	pthread_mutex_lock(&ez_writer_speed_cache_lock);
+	for (i = 0; i < EZ_WRITER_SPEED_CACHE_SIZE; i++) {
+		ewsc = &ez_writer_speed_cache[i];
+		if (ewsc->ewsc_speed != 0)
+			fprintf(file, "%u %s\n", ewsc->ewsc_speed,
+				ewsc->ewsc_identity);
+	}
+	pthread_mutex_unlock(&ez_writer_speed_cache_lock);
+
+	if (fclose(file) != 0 || rename(tmppath, path) == -1) {
+		error = errno;
+		unlink(tmppath);
+		errno = error;
+		return (false);
+	}
+	return (true);
+}
+
+const char *
+ez_writer_stage_name(int stage)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof ez_writer_commands / sizeof ez_writer_commands[0]; i++) {
+		if (ez_writer_commands[i].ewc_stage == stage)
+			return (ez_writer_commands[i].ewc_name);
+	}
+
+	/*
+	 * Stages which are not just a single command.
+	 */
+	switch (stage) {
+	case EZ_WRITER_STAGE_VERIFY:
+		return ("verify");
+	default:
+		return ("none");
+	}
+}
+
+void
+ez_writer_stock_init(struct ez_writer_stock *ews)
+{
+	memset(ews, 0, sizeof *ews);
+}
+
+bool
+ez_writer_stock_hico(const struct ez_writer_stock *ews)
+{
+	unsigned long high, low;
+
+	/*
+	 * Prefer whichever setting has the better rate of verified writes,
+	 * with one success and one failure assumed for each to start, so that
+	 * a single bad swipe does not decide it.  With nothing to go on, or
+	 * a tie, go with high coercivity, which is what most stock wants.
+	 */
+	high = (unsigned long)(ews->ews_verified[1] + 1) *
+	    (ews->ews_tries[0] + 2);
+	low = (unsigned long)(ews->ews_verified[0] + 1) *
+	    (ews->ews_tries[1] + 2);
+	return (high >= low);
+}
+
+bool
+ez_writer_version(struct serial_port *sport, char *buf, size_t len)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_version_locked(sport, buf, len);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_version_locked(struct serial_port *sport, char *buf, size_t len)
+{
+	char version_response[EZ_WRITER_VERSION_LENGTH];
+
+	ez_writer_stage(sport, EZ_WRITER_STAGE_VERSION);
+
+	if (len != EZ_WRITER_VERSION_LENGTH + 1)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_ARGUMENT, -1));
+
+	if (!ez_writer_command(sport, EZ_WRITER_COMMAND_VERSION, NULL,
+			       version_response))
 		return (false);
 
 	memcpy(buf, version_response, EZ_WRITER_VERSION_LENGTH);
@@ -224,90 +719,227 @@ ez_writer_version(struct serial_port *sport, char *buf, size_t len)
 bool
 ez_writer_write(struct serial_port *sport, bool hico, const struct card_data *cdata)
 {
-	static const char data_block_begin[] = {
-		EZ_WRITER_ESCAPE, 's'
-	};
-	static const char data_block_end[] = {
-		'?', '\x1c'
-	};
-	char write_response[2];
-	char coercivity_response[2];
+	return (ez_writer_write_tracks(sport, hico, EZ_WRITER_TRACK_MASK, cdata,
+				       NULL));
+}
 
-	if (hico) {
-		if (!EZ_WRITER_WRITE(sport, ez_writer_coercivity_high_string))
-			return (false);
-	} else {
-		if (!EZ_WRITER_WRITE(sport, ez_writer_coercivity_low_string))
-			return (false);
+bool
+ez_writer_write_auto(struct serial_port *sport, struct ez_writer_stock *ews,
+		     unsigned mask, const struct card_data *cdata,
+		     const struct card_data *current)
+{
+	bool ok;
+
+	serial_port_lock(sport);
+	ok = ez_writer_write_auto_locked(sport, ews, mask, cdata, current);
+	serial_port_unlock(sport);
+	return (ok);
+}
+
+static bool
+ez_writer_write_auto_locked(struct serial_port *sport, struct ez_writer_stock *ews,
+			    unsigned mask, const struct card_data *cdata,
+			    const struct card_data *current)
+{
+	struct card_data readback;
+	unsigned attempt;
+	bool hico, verify;
+
+	ez_writer_stage(sport, EZ_WRITER_STAGE_WRITE);
+
+	if ((mask & ~EZ_WRITER_TRACK_MASK) != 0)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_ARGUMENT, -1));
+
+	/*
+	 * If the card already holds what we would write, nothing is written,
+	 * so there is nothing to check and nothing learned about the stock.
+	 */
+	if (ez_writer_delta(mask, cdata, current) == 0)
+		return (true);
+
+	hico = ez_writer_stock_hico(ews);
+
+	/*
+	 * Reading a card back costs a swipe, so only do it while we are still
+	 * learning about the stock, and then on a sample of cards to notice
+	 * if it changes.
+	 */
+	verify = ews->ews_streak < EZ_WRITER_STOCK_CONFIDENT ||
+	    ews->ews_cards % EZ_WRITER_STOCK_SAMPLE == 0;
+	ews->ews_cards++;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (ez_writer_write_tracks_locked(sport, hico, mask, cdata,
+						  current)) {
+			if (!verify)
+				return (true);
+			ews->ews_tries[hico]++;
+			if (!ez_writer_read_locked(sport, &readback)) {
+				if (!ez_writer_recover_locked(sport))
+					return (false);
+			} else if (ez_writer_verify(mask, cdata, &readback)) {
+				ews->ews_verified[hico]++;
+				ews->ews_streak++;
+				return (true);
+			}
+		} else {
+			if (sport->sp_error.spe_fault ==
+			    SERIAL_PORT_FAULT_ARGUMENT)
+				return (false);
+			ews->ews_tries[hico]++;
+			if (!ez_writer_recover_locked(sport))
+				return (false);
+		}
+
+		/*
+		 * Try the same card again the other way, and this time make
+		 * sure of it.  We no longer know what is on the card, so write
+		 * every track.
+		 */
+		ews->ews_streak = 0;
+		hico = !hico;
+		current = NULL;
+		verify = true;
 	}
 
-	if (!EZ_WRITER_READ(sport, coercivity_response))
-		return (false);
+	ez_writer_stage(sport, EZ_WRITER_STAGE_VERIFY);
+	return (ez_writer_fail(sport, SERIAL_PORT_FAULT_STATUS, -1));
+}
 
-	if (coercivity_response[0] != EZ_WRITER_ESCAPE ||
-	    coercivity_response[1] != '0')
-		return (false);
+bool
+ez_writer_write_frame(struct serial_port *sport, const char *frame, size_t len)
+{
+	bool ok;
 
-	if (!EZ_WRITER_WRITE(sport, ez_writer_write_ascii_string))
-		return (false);
+	serial_port_lock(sport);
+	ok = ez_writer_write_frame_locked(sport, frame, len);
+	serial_port_unlock(sport);
+	return (ok);
+}
 
-	if (!EZ_WRITER_WRITE(sport, data_block_begin))
-		return (false);
+bool
+ez_writer_write_tracks(struct serial_port *sport, bool hico, unsigned mask,
+		       const struct card_data *cdata,
+		       const struct card_data *current)
+{
+	bool ok;
 
-	if (!ez_writer_write_track(sport, '\x1', cdata->cd_track1,
-				   sizeof cdata->cd_track1 / sizeof cdata->cd_track1[0]))
-		return (false);
+	serial_port_lock(sport);
+	ok = ez_writer_write_tracks_locked(sport, hico, mask, cdata, current);
+	serial_port_unlock(sport);
+	return (ok);
+}
 
-	if (!ez_writer_write_track(sport, '\x2', cdata->cd_track2,
-				   sizeof cdata->cd_track2 / sizeof cdata->cd_track2[0]))
-		return (false);
+static bool
+ez_writer_write_tracks_locked(struct serial_port *sport, bool hico,
+			      unsigned mask, const struct card_data *cdata,
+			      const struct card_data *current)
+{
+	char frame[EZ_WRITER_FRAME_LENGTH];
+	size_t len;
 
-	if (!ez_writer_write_track(sport, '\x3', cdata->cd_track3,
-				   sizeof cdata->cd_track3 / sizeof cdata->cd_track3[0]))
-		return (false);
+	ez_writer_stage(sport, EZ_WRITER_STAGE_WRITE);
 
-	if (!EZ_WRITER_WRITE(sport, data_block_end))
-		return (false);
+	/*
+	 * We only have three tracks.
+	 */
+	if ((mask & ~EZ_WRITER_TRACK_MASK) != 0)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_ARGUMENT, -1));
 
-	if (!EZ_WRITER_READ(sport, write_response))
-		return (false);
+	mask = ez_writer_delta(mask, cdata, current);
+
+	/*
+	 * Nothing needs writing, so do not make anyone swipe a card.
+	 */
+	if (mask == 0)
+		return (true);
 
-	if (write_response[0] != EZ_WRITER_ESCAPE || write_response[1] != '0')
+	if (!ez_writer_coercivity_locked(sport, hico))
 		return (false);
+
+	len = ez_writer_encode_write(frame, sizeof frame, mask, cdata);
+	return (ez_writer_write_frame_locked(sport, frame, len));
+}
+
+static bool
+ez_writer_verify(unsigned mask, const struct card_data *cdata, const struct card_data *readback)
+{
+	const char *trackdata, *readdata;
+	size_t len, readlen;
+	unsigned track;
+
+	for (track = 1; track <= 3; track++) {
+		if ((mask & EZ_WRITER_TRACK_TO_BITMASK(track)) == 0)
+			continue;
+		trackdata = ez_writer_track_data(cdata, track, &len);
+		readdata = ez_writer_track_data(readback, track, &readlen);
+		if (len != readlen || memcmp(trackdata, readdata, len) != 0)
+			return (false);
+	}
 	return (true);
 }
 
 static bool
-ez_writer_present(struct serial_port *sport)
+ez_writer_write_frame_locked(struct serial_port *sport, const char *frame, size_t len)
 {
-	char present_response[2];
+	ez_writer_stage(sport, EZ_WRITER_STAGE_WRITE);
 
-	if (!EZ_WRITER_WRITE(sport, ez_writer_present_string))
-		return (false);
+	if (len == 0)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_ARGUMENT, -1));
 
-	if (!EZ_WRITER_READ(sport, present_response))
+	if (!serial_port_write(sport, frame, len))
 		return (false);
 
-	if (present_response[0] != EZ_WRITER_ESCAPE ||
-	    present_response[1] != '4')
-		return (false);
-	return (true);
+	return (ez_writer_command_response(sport, EZ_WRITER_COMMAND_WRITE,
+					   NULL));
 }
 
 static bool
-ez_writer_ram_test(struct serial_port *sport)
+ez_writer_fail(struct serial_port *sport, int fault, int status)
 {
-	char test_response[2];
+	sport->sp_error.spe_fault = fault;
+	sport->sp_error.spe_status = status;
+	sport->sp_error.spe_errno = 0;
 
-	if (!EZ_WRITER_WRITE(sport, ez_writer_ram_test_string))
-		return (false);
+	/*
+	 * A bad status comes at the end of a complete response, so we are
+	 * still at a command boundary.  An argument error comes before we send
+	 * anything, so the line is wherever the last call left it.  If we
+	 * could not make sense of a response, who knows what else is still
+	 * coming.
+	 */
+	if (fault != SERIAL_PORT_FAULT_ARGUMENT)
+		sport->sp_error.spe_sync = fault == SERIAL_PORT_FAULT_STATUS;
+	return (false);
+}
 
-	if (!EZ_WRITER_READ(sport, test_response))
-		return (false);
+static bool
+ez_writer_present(struct serial_port *sport)
+{
+	return (ez_writer_command(sport, EZ_WRITER_COMMAND_PRESENT, NULL,
+				  NULL));
+}
 
-	if (test_response[0] != EZ_WRITER_ESCAPE || test_response[1] != '0')
+static bool
+ez_writer_probe(struct serial_port *sport)
+{
+	/*
+	 * Do not let anything the device sent at the wrong rate confuse the
+	 * next attempt.
+	 */
+	ez_writer_stage(sport, EZ_WRITER_STAGE_NEGOTIATE);
+
+	if (!serial_port_flush(sport))
 		return (false);
-	return (true);
+
+	return (ez_writer_command(sport, EZ_WRITER_COMMAND_PROBE, NULL, NULL));
+}
+
+static bool
+ez_writer_ram_test(struct serial_port *sport)
+{
+	return (ez_writer_command(sport, EZ_WRITER_COMMAND_RAM_TEST, NULL,
+				  NULL));
 }
 
 static bool
@@ -330,7 +962,9 @@ ez_writer_read_track(struct serial_port *sport, char *track, char *tuple)
 			if (!EZ_WRITER_READ(sport, byte))
 				return (false);
 			if (byte[0] != '*')
-				return (false);
+				return (ez_writer_fail(sport,
+						       SERIAL_PORT_FAULT_FRAMING,
+						       -1));
 			goto next_tuple;
 		}
 
@@ -360,56 +994,229 @@ next_tuple:
 static bool
 ez_writer_reset_buffer(struct serial_port *sport)
 {
-	if (!EZ_WRITER_WRITE(sport, ez_writer_reset_buffer_string))
-		return (false);
+	return (ez_writer_command(sport, EZ_WRITER_COMMAND_RESET_BUFFER, NULL,
+				  NULL));
+}
+
+static unsigned
+ez_writer_speed_lookup(const char *identity)
+{
+	unsigned speed;
+	unsigned i;
+
+	speed = 0;
+	pthread_mutex_lock(&ez_writer_speed_cache_lock);
+	for (i = 0; i < EZ_WRITER_SPEED_CACHE_SIZE; i++) {
+		if (ez_writer_speed_cache[i].ewsc_speed != 0 &&
+		    strcmp(ez_writer_speed_cache[i].ewsc_identity, identity) == 0) {
+			speed = ez_writer_speed_cache[i].ewsc_speed;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ez_writer_speed_cache_lock);
+	return (speed);
+}
 
-	sleep(1);
+static void
+ez_writer_speed_store(const char *identity, unsigned speed)
+{
+	struct ez_writer_speed_cache *ewsc;
+	unsigned i;
+
+	if (strlen(identity) >= sizeof ewsc->ewsc_identity)
+		return;
+
+	pthread_mutex_lock(&ez_writer_speed_cache_lock);
+	for (i = 0; i < EZ_WRITER_SPEED_CACHE_SIZE; i++) {
+		ewsc = &ez_writer_speed_cache[i];
+		if (ewsc->ewsc_speed != 0 &&
+		    strcmp(ewsc->ewsc_identity, identity) == 0) {
+			ewsc->ewsc_speed = speed;
+			pthread_mutex_unlock(&ez_writer_speed_cache_lock);
+			return;
+		}
+	}
 
+	/*
+	 * Otherwise take over the oldest entry.
+	 */
+	ewsc = &ez_writer_speed_cache[ez_writer_speed_cache_next];
+	ez_writer_speed_cache_next = (ez_writer_speed_cache_next + 1) %
+	    EZ_WRITER_SPEED_CACHE_SIZE;
+	strcpy(ewsc->ewsc_identity, identity);
+	ewsc->ewsc_speed = speed;
+	pthread_mutex_unlock(&ez_writer_speed_cache_lock);
+}
+
+static void
+ez_writer_stage(struct serial_port *sport, int stage)
+{
+	sport->sp_error.spe_stage = stage;
+	sport->sp_error.spe_fault = SERIAL_PORT_FAULT_NONE;
+	sport->sp_error.spe_status = -1;
+	sport->sp_error.spe_errno = 0;
+}
+
+static bool
+ez_writer_status(struct serial_port *sport, const char *response, char expected)
+{
+	if (response[0] != EZ_WRITER_ESCAPE)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_FRAMING, -1));
+	if (response[1] != expected)
+		return (ez_writer_fail(sport, SERIAL_PORT_FAULT_STATUS,
+				       (unsigned char)response[1]));
 	return (true);
 }
 
 static bool
 ez_writer_test(struct serial_port *sport)
 {
-	char test_response[2];
+	return (ez_writer_command(sport, EZ_WRITER_COMMAND_TEST, NULL, NULL));
+}
 
-	if (!EZ_WRITER_WRITE(sport, ez_writer_test_string))
-		return (false);
+static const char *
+ez_writer_track_data(const struct card_data *cdata, unsigned track, size_t *lenp)
+{
+	const char *trackdata;
+	size_t len;
+
+	switch (track) {
+	case 1:
+		trackdata = cdata->cd_track1;
+		len = sizeof cdata->cd_track1 / sizeof cdata->cd_track1[0];
+		break;
+	case 2:
+		trackdata = cdata->cd_track2;
+		len = sizeof cdata->cd_track2 / sizeof cdata->cd_track2[0];
+		break;
+	case 3:
+		trackdata = cdata->cd_track3;
+		len = sizeof cdata->cd_track3 / sizeof cdata->cd_track3[0];
+		break;
+	default:
+		abort();
+	}
 
-	if (!EZ_WRITER_READ(sport, test_response))
+	/*
+	 * If we are not using up a complete field, the length is the length
+	 * we are using.  Note that we are requiring the trackdata to be ASCII
+	 * NUL terminated.
+	 */
+	if (memchr(trackdata, '\0', len) != NULL)
+		len = strlen(trackdata);
+
+	*lenp = len;
+	return (trackdata);
+}
+
+/*
+ * Send a command from the table, and unless it has a data block to deal with
+ * first, get and check its response.  The argument and response buffers are
+ * only needed by commands which have them, and a response which is only a
+ * status need not be kept.
+ */
+static bool
+ez_writer_command(struct serial_port *sport, unsigned command, const char *arg, char *response)
+{
+	const struct ez_writer_command *cmd;
+
+	cmd = &ez_writer_commands[command];
+
+	ez_writer_stage(sport, cmd->ewc_stage);
+
+	if (!serial_port_write(sport, cmd->ewc_bytes, cmd->ewc_len))
 		return (false);
 
-	if (test_response[0] != EZ_WRITER_ESCAPE || test_response[1] != 'y')
+	if (cmd->ewc_arglen != 0 &&
+	    !serial_port_write(sport, arg, cmd->ewc_arglen))
 		return (false);
-	return (true);
+
+	if (cmd->ewc_block)
+		return (true);
+
+	return (ez_writer_command_response(sport, command, response));
 }
 
 static bool
-ez_writer_write_track(struct serial_port *sport, unsigned track, const char *trackdata, size_t len)
+ez_writer_command_response(struct serial_port *sport, unsigned command, char *response)
 {
-	char track_begin[] = {
-		EZ_WRITER_ESCAPE, track & (EZ_WRITER_TRACK_TO_BITMASK(1) |
-					   EZ_WRITER_TRACK_TO_BITMASK(2) |
-					   EZ_WRITER_TRACK_TO_BITMASK(3))
-	};
+	const struct ez_writer_command *cmd;
+	char status[2];
+	bool ok;
+
+	cmd = &ez_writer_commands[command];
+
+	if (cmd->ewc_delay != 0)
+		serial_port_delay(sport, cmd->ewc_delay);
 
-	if (!EZ_WRITER_WRITE(sport, track_begin))
+	if (cmd->ewc_response == 0)
+		return (true);
+
+	if (response == NULL)
+		response = status;
+
+	if (cmd->ewc_swipe)
+		ok = serial_port_read(sport, response, cmd->ewc_response);
+	else
+		ok = serial_port_read_timeout(sport, response,
+					      cmd->ewc_response,
+					      cmd->ewc_timeout != 0 ?
+					      cmd->ewc_timeout :
+					      EZ_WRITER_COMMAND_TIMEOUT);
+	if (!ok)
+		return (false);
+
+	if (cmd->ewc_status != '\0' &&
+	    !ez_writer_status(sport, response, cmd->ewc_status))
 		return (false);
 
 	/*
-	 * If we are not using up a complete field, set the len to the length
-	 * we are using.  Note that we are requiring the trackdata to be ASCII
-	 * NUL terminated.
+	 * The whole response was read and made sense, so we are back at a
+	 * command boundary, whatever happened before.
 	 */
-	if (memchr(trackdata, '\0', len) != NULL)
-		len = strlen(trackdata);
+	sport->sp_error.spe_fault = SERIAL_PORT_FAULT_NONE;
+	sport->sp_error.spe_sync = true;
+	return (true);
+}
+
+/*
+ * If we know what is on the card already, there is no point in writing the
+ * tracks which would come out the same.  Returns the tracks left to write.
+ */
+static unsigned
+ez_writer_delta(unsigned mask, const struct card_data *cdata, const struct card_data *current)
+{
+	const char *trackdata, *currentdata;
+	size_t len, currentlen;
+	unsigned track;
+
+	if (current == NULL)
+		return (mask);
+
+	for (track = 1; track <= 3; track++) {
+		if ((mask & EZ_WRITER_TRACK_TO_BITMASK(track)) == 0)
+			continue;
+		trackdata = ez_writer_track_data(cdata, track, &len);
+		currentdata = ez_writer_track_data(current, track, &currentlen);
+		if (len == currentlen &&
+		    memcmp(trackdata, currentdata, len) == 0)
+			mask &= ~EZ_WRITER_TRACK_TO_BITMASK(track);
+	}
+	return (mask);
+}
+
+static size_t
+ez_writer_encode_track(char *frame, unsigned track, const char *trackdata, size_t len)
+{
+	frame[0] = EZ_WRITER_ESCAPE;
+	frame[1] = track;
 
 	/*
 	 * If this track is empty, write nothing, rather than ^[*, which is
 	 * what comes on read for a null track.
 	 */
 	if (len == 0)
-		return (true);
+		return (2);
 
 	/*
 	 * This is ridiculous.
@@ -419,8 +1226,8 @@ ez_writer_write_track(struct serial_port *sport, unsigned track, const char *tra
 	 *
 	 * Compensate by skipping the start and end characters.
 	 */
-	if (!serial_port_write(sport, trackdata + 1, len - 2))
-		return (false);
-
-	return (true);
+	if (len < 2)
+		return (2);
+	memcpy(frame + 2, trackdata + 1, len - 2);
+	return (len);
 }
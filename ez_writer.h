@@ -4,15 +4,69 @@
 #define	EZ_WRITER_TRACK_TO_BITMASK(track)				\
 	((1) << ((track) & (1 | 2 | 3)))
 
+#define	EZ_WRITER_TRACK_MASK						\
+	(EZ_WRITER_TRACK_TO_BITMASK(1) |				\
+	 EZ_WRITER_TRACK_TO_BITMASK(2) |				\
+	 EZ_WRITER_TRACK_TO_BITMASK(3))
+
 struct card_data;
 struct serial_port;
 
 #define	EZ_WRITER_VERSION_LENGTH	(40)
 
+/*
+ * Big enough for a write command with all three tracks full.
+ */
+#define	EZ_WRITER_FRAME_LENGTH		(256)
+
+/*
+ * What we were doing when an operation failed, as found in the spe_stage of
+ * the port's struct serial_port_error.
+ */
+#define	EZ_WRITER_STAGE_NONE		(0)
+#define	EZ_WRITER_STAGE_PRESENT		(1)
+#define	EZ_WRITER_STAGE_RESET_BUFFER	(2)
+#define	EZ_WRITER_STAGE_TEST		(3)
+#define	EZ_WRITER_STAGE_RAM_TEST	(4)
+#define	EZ_WRITER_STAGE_VERSION		(5)
+#define	EZ_WRITER_STAGE_COERCIVITY	(6)
+#define	EZ_WRITER_STAGE_READ		(7)
+#define	EZ_WRITER_STAGE_WRITE		(8)
+#define	EZ_WRITER_STAGE_ERASE		(9)
+#define	EZ_WRITER_STAGE_NEGOTIATE	(10)
+#define	EZ_WRITER_STAGE_VERIFY		(11)
+
+/*
+ * What has been learned about the card stock going through a writer, for
+ * picking the coercivity of each write in auto mode.  Arrays are indexed by
+ * hico.  Start each batch of cards with ez_writer_stock_init.
+ */
+struct ez_writer_stock {
+	unsigned ews_tries[2];
+	unsigned ews_verified[2];
+	unsigned ews_streak;
+	unsigned ews_cards;
+};
+
 bool ez_writer_initialize(struct serial_port *);
+bool ez_writer_coercivity(struct serial_port *, bool);
+size_t ez_writer_encode_write(char *, size_t, unsigned, const struct card_data *);
 bool ez_writer_erase(struct serial_port *, unsigned);
+bool ez_writer_erase_auto(struct serial_port *, struct ez_writer_stock *, unsigned);
+bool ez_writer_negotiate_speed(struct serial_port *, const char *);
 bool ez_writer_read(struct serial_port *, struct card_data *);
+bool ez_writer_recover(struct serial_port *);
+bool ez_writer_speed_cache_load(const char *);
+bool ez_writer_speed_cache_save(const char *);
+const char *ez_writer_stage_name(int);
+void ez_writer_stock_init(struct ez_writer_stock *);
+bool ez_writer_stock_hico(const struct ez_writer_stock *);
 bool ez_writer_version(struct serial_port *, char *, size_t);
 bool ez_writer_write(struct serial_port *, bool, const struct card_data *);
+bool ez_writer_write_auto(struct serial_port *, struct ez_writer_stock *, unsigned,
+			  const struct card_data *, const struct card_data *);
+bool ez_writer_write_frame(struct serial_port *, const char *, size_t);
+bool ez_writer_write_tracks(struct serial_port *, bool, unsigned,
+			    const struct card_data *, const struct card_data *);
 
 #endif /* !EZ_WRITER_H */
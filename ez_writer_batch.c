@@ -0,0 +1,192 @@
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "card_data.h"
+#include "ez_writer.h"
+#include "ez_writer_batch.h"
+#include "serial.h"
+
+/*
+ * Writing a stack of cards.  All the device is doing while a card is in the
+ * slot is waiting for someone to swipe it, so everything else should happen
+ * in that time: while the caller's thread has the device waiting on card N,
+ * a second thread builds the write command for card N+1 and journals card
+ * N-1.  Frames live in a small ring of preallocated slots which the two
+ * threads pass back and forth.
+ *
+ * The caller's thread holds the port lock for the whole batch, so the
+ * journal, which runs on the other thread, must keep its hands off the port.
+ */
+
+#define	EZ_WRITER_BATCH_SLOTS		(4)
+
+#define	EZ_WRITER_BATCH_SLOT_FREE	(0)	/* Ready to be encoded into.  */
+#define	EZ_WRITER_BATCH_SLOT_READY	(1)	/* Encoded, not yet written.  */
+#define	EZ_WRITER_BATCH_SLOT_DONE	(2)	/* Written, not yet journaled.  */
+
+struct ez_writer_batch_slot {
+	int ebs_state;
+	size_t ebs_len;
+	bool ebs_ok;
+	char ebs_frame[EZ_WRITER_FRAME_LENGTH];
+};
+
+struct ez_writer_batch {
+	pthread_mutex_t eb_lock;
+	pthread_cond_t eb_cond;
+	const struct card_data *eb_cards;
+	size_t eb_count;
+	unsigned eb_mask;
+	bool eb_stop;
+	ez_writer_batch_journal_t *eb_journal;
+	void *eb_arg;
+	struct ez_writer_batch_slot eb_slots[EZ_WRITER_BATCH_SLOTS];
+};
+
+static void *ez_writer_batch_stager(void *);
+
+size_t
+ez_writer_batch_write(struct serial_port *sport, bool hico, const struct card_data *cards, size_t count, ez_writer_batch_journal_t *journal, void *arg)
+{
+	struct ez_writer_batch eb;
+	struct ez_writer_batch_slot *slot;
+	pthread_t stager;
+	size_t i, written;
+	bool ok;
+
+	if (count == 0)
+		return (0);
+
+	memset(&eb, 0, sizeof eb);
+	pthread_mutex_init(&eb.eb_lock, NULL);
+	pthread_cond_init(&eb.eb_cond, NULL);
+	eb.eb_cards = cards;
+	eb.eb_count = count;
+	eb.eb_mask = EZ_WRITER_TRACK_MASK;
+	eb.eb_stop = false;
+	eb.eb_journal = journal;
+	eb.eb_arg = arg;
+	for (i = 0; i < EZ_WRITER_BATCH_SLOTS; i++)
+		eb.eb_slots[i].ebs_state = EZ_WRITER_BATCH_SLOT_FREE;
+
+	/*
+	 * Hold the device for the whole batch, and only set the coercivity
+	 * once; it stays put between writes.
+	 */
+	written = 0;
+	serial_port_lock(sport);
+	if (!ez_writer_coercivity(sport, hico))
+		goto out;
+
+	if (pthread_create(&stager, NULL, ez_writer_batch_stager, &eb) != 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		slot = &eb.eb_slots[i % EZ_WRITER_BATCH_SLOTS];
+
+		pthread_mutex_lock(&eb.eb_lock);
+		while (slot->ebs_state != EZ_WRITER_BATCH_SLOT_READY)
+			pthread_cond_wait(&eb.eb_cond, &eb.eb_lock);
+		pthread_mutex_unlock(&eb.eb_lock);
+
+		/*
+		 * The slot is ours until we mark it done, so the frame can be
+		 * sent without holding the batch lock.
+		 */
+		ok = ez_writer_write_frame(sport, slot->ebs_frame,
+					   slot->ebs_len);
+
+		pthread_mutex_lock(&eb.eb_lock);
+		slot->ebs_ok = ok;
+		slot->ebs_state = EZ_WRITER_BATCH_SLOT_DONE;
+		if (!ok)
+			eb.eb_stop = true;
+		pthread_cond_broadcast(&eb.eb_cond);
+		pthread_mutex_unlock(&eb.eb_lock);
+
+		if (!ok)
+			break;
+		written++;
+	}
+
+	pthread_join(stager, NULL);
+out:
+	serial_port_unlock(sport);
+	pthread_cond_destroy(&eb.eb_cond);
+	pthread_mutex_destroy(&eb.eb_lock);
+	return (written);
+}
+
+static void *
+ez_writer_batch_stager(void *arg)
+{
+	struct ez_writer_batch *eb;
+	struct ez_writer_batch_slot *slot;
+	size_t encode, journal, len;
+	bool ok;
+
+	eb = arg;
+	encode = journal = 0;
+
+	pthread_mutex_lock(&eb->eb_lock);
+	for (;;) {
+		/*
+		 * Journal finished cards first, in order, since that is what
+		 * frees up slots to encode into.
+		 */
+		slot = &eb->eb_slots[journal % EZ_WRITER_BATCH_SLOTS];
+		if (journal < encode &&
+		    slot->ebs_state == EZ_WRITER_BATCH_SLOT_DONE) {
+			ok = slot->ebs_ok;
+			pthread_mutex_unlock(&eb->eb_lock);
+			if (eb->eb_journal != NULL)
+				eb->eb_journal(eb->eb_arg, journal,
+					       &eb->eb_cards[journal], ok);
+			pthread_mutex_lock(&eb->eb_lock);
+			slot->ebs_state = EZ_WRITER_BATCH_SLOT_FREE;
+			journal++;
+			pthread_cond_broadcast(&eb->eb_cond);
+			continue;
+		}
+
+		/*
+		 * Everything has been written and journaled, or a write has
+		 * failed and everything up to it has been journaled.  Frames
+		 * encoded past a failure are just dropped.
+		 */
+		if (journal == eb->eb_count)
+			break;
+		if (eb->eb_stop && (journal == encode ||
+		    slot->ebs_state != EZ_WRITER_BATCH_SLOT_DONE))
+			break;
+
+		slot = &eb->eb_slots[encode % EZ_WRITER_BATCH_SLOTS];
+		if (!eb->eb_stop && encode < eb->eb_count &&
+		    slot->ebs_state == EZ_WRITER_BATCH_SLOT_FREE) {
+			pthread_mutex_unlock(&eb->eb_lock);
+			/*
+			 * A card which cannot be encoded gets an empty frame,
+			 * which fails when written, so the batch stops there
+			 * just as it would for a bad swipe.
+			 */
+			len = ez_writer_encode_write(slot->ebs_frame,
+						     sizeof slot->ebs_frame,
+						     eb->eb_mask,
+						     &eb->eb_cards[encode]);
+			pthread_mutex_lock(&eb->eb_lock);
+			slot->ebs_len = len;
+			slot->ebs_state = EZ_WRITER_BATCH_SLOT_READY;
+			encode++;
+			pthread_cond_broadcast(&eb->eb_cond);
+			continue;
+		}
+
+		pthread_cond_wait(&eb->eb_cond, &eb->eb_lock);
+	}
+	pthread_mutex_unlock(&eb->eb_lock);
+
+	return (NULL);
+}
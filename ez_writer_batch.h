@@ -0,0 +1,18 @@
+#ifndef	EZ_WRITER_BATCH_H
+#define	EZ_WRITER_BATCH_H
+
+struct card_data;
+struct serial_port;
+
+/*
+ * Called for each card once its write has finished, in order, with whether
+ * it succeeded.  Runs on a thread of its own, not the caller's, while the
+ * batch holds the port, so it must not use the port at all: any ez_writer
+ * call on it would wait for the batch, which is waiting for the journal.
+ * Read cards back after ez_writer_batch_write returns, if at all.
+ */
+typedef void ez_writer_batch_journal_t(void *, size_t, const struct card_data *, bool);
+
+size_t ez_writer_batch_write(struct serial_port *, bool, const struct card_data *, size_t, ez_writer_batch_journal_t *, void *);
+
+#endif /* !EZ_WRITER_BATCH_H */
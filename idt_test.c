@@ -1,45 +1,86 @@
 #include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "card_data.h"
+#include "card_index.h"
+#include "device_lease.h"
 #include "ez_writer.h"
+#include "metrics.h"
 #include "serial.h"
+#include "serial_discovery.h"
+#include "serial_replay.h"
 #include "string_set.h"
 
-struct pick_context {
-	unsigned long pc_pick;
-	unsigned long pc_counter;
-	const char *pc_name;
-};
-
 struct print_context {
 	unsigned long pc_counter;
 	FILE *pc_handle;
 };
 
+static void begin_operation(struct metrics_device *, const char *);
 static bool choose_serial_port(struct serial_port *, const char *);
-static void pick_serial_port(void *, const char *);
+static bool end_operation(struct metrics_device *, struct serial_port *, bool);
+static bool find_serial_port(const char *, char *, size_t);
+static struct device_lease *lease_serial_port(const char *, const char *);
 static void print_serial_port(void *, const char *);
 
 int
 main(int argc, char *argv[])
 {
 	char version[EZ_WRITER_VERSION_LENGTH + 1];
+	char devpath[SERIAL_DEVICE_PATH_LENGTH];
 	struct serial_port sport;
 	bool doread, dowrite, doerase;
+	bool hico, autocoercivity;
+	bool ok;
+	struct metrics_device *device;
+	struct metrics *metrics;
+	const char *metricsname;
+	struct ez_writer_stock stock;
+	struct serial_transcript *transcript;
+	struct device_lease *lease;
+	struct card_index *index;
 	struct card_data cdata;
+	const char *leasedir;
+	const char *replayname;
+	const char *recordname;
+	const char *indexname;
 	const char *portname;
+	const char *identity;
+	const char *speed;
+	const char *speedname;
+	unsigned mask;
+	char *end;
 	int ch;
 
 	memset(&cdata, 0, sizeof cdata);
 	doread = dowrite = doerase = false;
+	hico = true;
+	autocoercivity = false;
+	metrics = NULL;
+	metricsname = NULL;
+	device = NULL;
+	ez_writer_stock_init(&stock);
+	transcript = NULL;
+	replayname = NULL;
+	recordname = NULL;
+	lease = NULL;
+	leasedir = NULL;
+	index = NULL;
+	indexname = NULL;
 	portname = NULL;
+	identity = NULL;
+	speed = NULL;
+	speedname = NULL;
+	mask = EZ_WRITER_TRACK_MASK;
 
-	while ((ch = getopt(argc, argv, "1:2:3:rwe?")) != -1) {
+	while ((ch = getopt(argc, argv, "1:2:3:b:c:d:l:m:t:u:R:S:T:rwe?")) != -1) {
 		switch (ch) {
 		case '1':
 			strlcpy(cdata.cd_track1, optarg, sizeof cdata.cd_track1);
@@ -50,6 +91,62 @@ main(int argc, char *argv[])
 		case '3':
 			strlcpy(cdata.cd_track3, optarg, sizeof cdata.cd_track3);
 			break;
+		case 'b':
+			speed = optarg;
+			break;
+		case 'c':
+			/*
+			 * Coercivity: high, low, or auto to work it out from
+			 * how writes read back.
+			 */
+			if (strcmp(optarg, "high") == 0)
+				hico = true;
+			else if (strcmp(optarg, "low") == 0)
+				hico = false;
+			else if (strcmp(optarg, "auto") == 0)
+				autocoercivity = true;
+			else /* XXX usage */
+				return (1);
+			break;
+		case 'd':
+			indexname = optarg;
+			break;
+		case 'l':
+			leasedir = optarg;
+			break;
+		case 'm':
+			/*
+			 * Serve live metrics on a localhost port or a Unix
+			 * socket.
+			 */
+			metricsname = optarg;
+			break;
+		case 't':
+			/*
+			 * Tracks to erase and write, as digits, e.g. "13".
+			 */
+			mask = 0;
+			for (end = optarg; *end != '\0'; end++) {
+				if (*end < '1' || *end > '3') /* XXX usage */
+					return (1);
+				mask |= EZ_WRITER_TRACK_TO_BITMASK(*end - '0');
+			}
+			break;
+		case 'u':
+			identity = optarg;
+			break;
+		case 'R':
+			replayname = optarg;
+			break;
+		case 'S':
+			/*
+			 * Remember negotiated speeds between runs.
+			 */
+			speedname = optarg;
+			break;
+		case 'T':
+			recordname = optarg;
+			break;
 		case 'r':
 			doread = true;
 			break;
@@ -75,11 +172,109 @@ main(int argc, char *argv[])
 	if (argc != 0) /* XXX usage */
 		return (1);
 
-	if (!choose_serial_port(&sport, portname)) {
+	if (identity != NULL) {
+		if (portname != NULL) /* XXX usage */
+			return (1);
+		if (!find_serial_port(identity, devpath, sizeof devpath)) {
+			fprintf(stderr, "No serial port matches %s.\n",
+				identity);
+			return (1);
+		}
+		portname = devpath;
+	}
+
+	/*
+	 * Only one card is checked per run, which is not worth building a
+	 * Bloom filter for; the lookup only touches a page or two of the
+	 * mapped table.
+	 */
+	if (dowrite && indexname != NULL) {
+		index = card_index_load(indexname, false);
+		if (index == NULL && errno == ENOENT)
+			index = card_index_create(0, false);
+		if (index == NULL) {
+			fprintf(stderr, "Unable to load card index.\n");
+			return (1);
+		}
+	}
+
+	/*
+	 * With a lease directory, share the ports with anyone else using the
+	 * same one, waiting for the given port, or for whichever comes free
+	 * first if none was given.
+	 */
+	if (leasedir != NULL) {
+		lease = lease_serial_port(leasedir, portname);
+		if (lease == NULL) {
+			fprintf(stderr, "Unable to lease serial port.\n");
+			return (1);
+		}
+		portname = device_lease_device(lease);
+	}
+
+	/*
+	 * Play a recorded session back rather than talking to a device, as
+	 * fast as it will go.
+	 */
+	if (replayname != NULL) {
+		transcript = serial_transcript_load(replayname);
+		if (transcript == NULL) {
+			fprintf(stderr, "Unable to load transcript.\n");
+			return (1);
+		}
+		if (!serial_port_open_replay(&sport, transcript, true)) {
+			fprintf(stderr, "Unable to load transcript.\n");
+			serial_port_close(&sport);
+			return (1);
+		}
+	} else if (!choose_serial_port(&sport, portname)) {
 		fprintf(stderr, "Unable to attach serial port.\n");
 		return (1);
 	}
 
+	if (recordname != NULL && !serial_port_record(&sport, recordname)) {
+		fprintf(stderr, "Unable to record transcript.\n");
+		return (1);
+	}
+
+	if (speed != NULL && strcmp(speed, "auto") == 0) {
+		if (speedname != NULL &&
+		    !ez_writer_speed_cache_load(speedname) && errno != ENOENT) {
+			fprintf(stderr, "Unable to load speed cache.\n");
+			return (1);
+		}
+		if (!ez_writer_negotiate_speed(&sport,
+					       identity != NULL ? identity :
+					       portname)) {
+			fprintf(stderr, "Unable to negotiate line speed.\n");
+			return (1);
+		}
+		fprintf(stderr, "Line speed: %u\n", sport.sp_config.spc_speed);
+		if (speedname != NULL && !ez_writer_speed_cache_save(speedname)) {
+			fprintf(stderr, "Unable to save speed cache.\n");
+			return (1);
+		}
+	} else if (speed != NULL) {
+		struct serial_port_config config;
+
+		config = sport.sp_config;
+		config.spc_speed = strtoul(speed, &end, 10);
+		if (*end != '\0' || !serial_port_configure(&sport, &config)) {
+			fprintf(stderr, "Unable to set line speed.\n");
+			return (1);
+		}
+	}
+
+	if (metricsname != NULL) {
+		metrics = metrics_create(metricsname);
+		if (metrics == NULL) {
+			fprintf(stderr, "Unable to serve metrics.\n");
+			return (1);
+		}
+		device = metrics_device(metrics,
+					portname != NULL ? portname : "serial");
+	}
+
 	if (!ez_writer_initialize(&sport)) {
 		fprintf(stderr, "Unable to initialize EZ Writer.\n");
 		return (1);
@@ -95,7 +290,9 @@ main(int argc, char *argv[])
 	if (doread) {
 		fprintf(stderr,
 			"Swipe a card to read when the LED changes color.\n");
-		if (!ez_writer_read(&sport, &cdata)) {
+		begin_operation(device, METRICS_OP_READ);
+		ok = ez_writer_read(&sport, &cdata);
+		if (!end_operation(device, &sport, ok)) {
 			fprintf(stderr, "Failed to read a card.\n");
 			return (1);
 		}
@@ -105,34 +302,84 @@ main(int argc, char *argv[])
 	if (doerase) {
 		fprintf(stderr,
 			"Swipe a card to erase when the LED changes color.\n");
-		if (!ez_writer_erase(&sport,
-				     EZ_WRITER_TRACK_TO_BITMASK(1) |
-				     EZ_WRITER_TRACK_TO_BITMASK(2) |
-				     EZ_WRITER_TRACK_TO_BITMASK(3))) {
+		begin_operation(device, METRICS_OP_ERASE);
+		if (autocoercivity)
+			ok = ez_writer_erase_auto(&sport, &stock, mask);
+		else
+			ok = ez_writer_coercivity(&sport, hico) &&
+			    ez_writer_erase(&sport, mask);
+		if (!end_operation(device, &sport, ok)) {
 			fprintf(stderr, "Failed to erase a card.\n");
 			return (1);
 		}
 	}
 
 	if (dowrite) {
+		/*
+		 * Check what is actually about to be written, which with -r
+		 * is what was just read rather than what was given.
+		 */
+		if (index != NULL && card_index_contains(index, &cdata)) {
+			fprintf(stderr, "Card data has already been written.\n");
+			return (1);
+		}
 		card_data_dump(&cdata);
 		fprintf(stderr,
 			"Swipe a card to write data to.\n");
-		if (!ez_writer_write(&sport, true, &cdata)) {
+		begin_operation(device, METRICS_OP_WRITE);
+		if (autocoercivity) {
+			fprintf(stderr,
+				"Swipe it again when the LED changes color, to check it.\n");
+			ok = ez_writer_write_auto(&sport, &stock, mask, &cdata,
+						  NULL);
+		} else {
+			ok = ez_writer_write_tracks(&sport, hico, mask, &cdata,
+						    NULL);
+		}
+		if (!end_operation(device, &sport, ok)) {
 			fprintf(stderr, "Failed to write a card.\n");
 			return (1);
 		}
+		if (index != NULL) {
+			card_index_add(index, &cdata);
+			if (!card_index_save(index, indexname)) {
+				fprintf(stderr, "Unable to save card index.\n");
+				return (1);
+			}
+			card_index_free(index);
+		}
 	}
 
+	if (transcript != NULL &&
+	    !serial_replay_finished(sport.sp_replay)) {
+		fprintf(stderr, "Session did not match the transcript.\n");
+		return (1);
+	}
+
+	if (metrics != NULL)
+		metrics_free(metrics);
+	serial_port_close(&sport);
+	if (transcript != NULL)
+		serial_transcript_free(transcript);
+	if (lease != NULL)
+		device_lease_release(lease);
+
 	return (0);
 }
 
+static void
+begin_operation(struct metrics_device *device, const char *op)
+{
+	if (device != NULL)
+		metrics_begin(device, op);
+}
+
 static bool
 choose_serial_port(struct serial_port *sport, const char *portname)
 {
 	struct string_set *serial_ports;
 	struct print_context pc;
-	struct pick_context pk;
+	unsigned long pick;
 	char *line, *end;
 	size_t len;
 
@@ -145,6 +392,8 @@ choose_serial_port(struct serial_port *sport, const char *portname)
 	}
 
 	serial_ports = serial_port_enumerate();
+	if (serial_ports == NULL)
+		return (false);
 	string_set_foreach(serial_ports, print_serial_port, &pc);
 
 	if (pc.pc_counter == 0) {
@@ -153,10 +402,6 @@ choose_serial_port(struct serial_port *sport, const char *portname)
 		return (false);
 	}
 
-	pk.pc_counter = 0;
-	pk.pc_name = NULL;
-	pk.pc_pick = 0;
-
 	for (;;) {
 		fprintf(pc.pc_handle, "Please enter the number corresponding with the port you would like to use.\n");
 		line = fgetln(stdin, &len);
@@ -165,30 +410,21 @@ choose_serial_port(struct serial_port *sport, const char *portname)
 		line[len - 1] = '\0';
 		if (line[0] == '\0')
 			continue;
-		pk.pc_pick = strtoul(line, &end, 10);
-		if (*end != '\0') {
-			pk.pc_pick = 0;
+		pick = strtoul(line, &end, 10);
+		if (*end != '\0')
 			continue;
-		}
-		if (pk.pc_pick < 1 || pk.pc_pick > pc.pc_counter) {
-			pk.pc_pick = 0;
+		if (pick < 1 || pick > string_set_count(serial_ports))
 			continue;
-		}
 		break;
 	}
 
-	string_set_foreach(serial_ports, pick_serial_port, &pk);
-	if (pk.pc_name == NULL) {
-		string_set_free(serial_ports);
-		return (false);
-	}
-
-	portname = pk.pc_name;
+	portname = string_set_get(serial_ports, pick - 1);
 
 open_port:
 	fprintf(pc.pc_handle, "Serial port selected: %s\n", portname);
 
 	if (!serial_port_open(sport, portname)) {
+		serial_port_close(sport);
 		if (serial_ports != NULL)
 			string_set_free(serial_ports);
 		return (false);
@@ -199,16 +435,115 @@ open_port:
 	return (true);
 }
 
-static void
-pick_serial_port(void *arg, const char *port)
+static bool
+end_operation(struct metrics_device *device, struct serial_port *sport, bool ok)
 {
-	struct pick_context *pc;
+	if (device == NULL)
+		return (ok);
+	if (!ok)
+		metrics_error(device,
+			      ez_writer_stage_name(sport->sp_error.spe_stage),
+			      sport->sp_error.spe_fault);
+	metrics_end(device, ok);
+	return (ok);
+}
 
-	pc = arg;
-	pc->pc_counter++;
+/*
+ * Find a USB serial port by identity, given as vendor:product[:serial], with
+ * the IDs in hex as lsusb prints them.
+ */
+static bool
+find_serial_port(const char *identity, char *path, size_t len)
+{
+	const struct serial_device *sdev;
+	struct serial_discovery *sd;
+	unsigned long vendor, product;
+	const char *serial;
+	char *end;
+
+	vendor = strtoul(identity, &end, 16);
+	if (*end != ':')
+		return (false);
+	product = strtoul(end + 1, &end, 16);
+	if (*end == ':')
+		serial = end + 1;
+	else if (*end == '\0')
+		serial = NULL;
+	else
+		return (false);
+
+	sd = serial_discovery_create();
+	if (sd == NULL)
+		return (false);
+
+	sdev = serial_discovery_find(sd, vendor, product, serial);
+	if (sdev == NULL) {
+		serial_discovery_free(sd);
+		return (false);
+	}
+
+	strlcpy(path, sdev->sdev_path, len);
+	serial_discovery_free(sd);
+	return (true);
+}
+
+static struct device_lease *
+lease_serial_port(const char *dir, const char *portname)
+{
+	struct string_set *serial_ports;
+	struct device_lease *lease;
+	char path[MAXPATHLEN];
+	char **names;
+	size_t count, i;
+
+	/*
+	 * Lease ports by the path that will be opened, so that however a port
+	 * was named here, everyone agrees which device it is.
+	 */
+	if (portname != NULL) {
+		if (!serial_port_path(portname, path, sizeof path))
+			return (NULL);
+		lease = device_lease_acquire(dir, path, false);
+		if (lease == NULL && errno == EWOULDBLOCK) {
+			fprintf(stdout, "Waiting for a serial port to come free.\n");
+			lease = device_lease_acquire(dir, path, true);
+		}
+		return (lease);
+	}
+
+	serial_ports = serial_port_enumerate();
+	if (serial_ports == NULL)
+		return (NULL);
+
+	count = string_set_count(serial_ports);
+	names = calloc(count, sizeof names[0]);
+	if (names == NULL) {
+		string_set_free(serial_ports);
+		return (NULL);
+	}
+	lease = NULL;
+	for (i = 0; i < count; i++) {
+		if (!serial_port_path(string_set_get(serial_ports, i), path,
+				      sizeof path) ||
+		    (names[i] = strdup(path)) == NULL)
+			goto out;
+	}
+
+	lease = device_lease_acquire_any(dir, (const char *const *)names,
+					 count, false);
+	if (lease == NULL && errno == EWOULDBLOCK) {
+		fprintf(stdout, "Waiting for a serial port to come free.\n");
+		lease = device_lease_acquire_any(dir,
+						 (const char *const *)names,
+						 count, true);
+	}
 
-	if (pc->pc_counter == pc->pc_pick)
-		pc->pc_name = port;
+out:
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	string_set_free(serial_ports);
+	return (lease);
 }
 
 static void
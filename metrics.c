@@ -0,0 +1,665 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+ * Live station state for whoever is keeping an eye on things, served over
+ * HTTP in the Prometheus text format, either on a port on localhost or on a
+ * Unix socket; we never listen on anything that can be reached from another
+ * host.
+ *
+ * The serial side only ever takes a device's own lock long enough to update
+ * a few counters.  Everything else, from accepting connections to sorting
+ * latencies and formatting the page, happens on the metrics thread, working
+ * from a snapshot and into buffers allocated up front, so a slow or stuck
+ * scraper costs the devices nothing.
+ *
+ * All times are in microseconds.
+ */
+
+#define	METRICS_DEVICES		(16)
+#define	METRICS_NAME_LENGTH	(64)
+#define	METRICS_SAMPLES		(128)	/* Latencies kept.  */
+#define	METRICS_WINDOW		(60)	/* Seconds of completions counted.  */
+#define	METRICS_BUFFER_SIZE	(METRICS_DEVICES * 2048)
+#define	METRICS_REQUEST_TIMEOUT	(1000)	/* Milliseconds.  */
+#define	METRICS_RESPONSE_TIMEOUT (1000)	/* Milliseconds.  */
+
+/*
+ * A scraper hanging up early must not take the whole process with it.
+ */
+#ifdef	MSG_NOSIGNAL
+#define	METRICS_SEND_FLAGS	(MSG_NOSIGNAL)
+#else
+#define	METRICS_SEND_FLAGS	(0)
+#endif
+
+struct metrics_device {
+	pthread_mutex_t md_lock;
+	char md_name[METRICS_NAME_LENGTH];
+	const char *md_op;
+	uint64_t md_started;
+	size_t md_queued;
+	uint64_t md_ok;
+	uint64_t md_failed;
+	const char *md_error_stage;
+	int md_error_fault;
+	uint64_t md_error_time;
+	uint64_t md_latencies[METRICS_SAMPLES];
+	uint64_t md_samples;
+	uint64_t md_seconds[METRICS_WINDOW];	/* Second each count is for.  */
+	uint64_t md_completions[METRICS_WINDOW];
+};
+
+#define	METRICS_QUANTILES	(3)
+
+static const unsigned metrics_quantiles[METRICS_QUANTILES] = {
+	50, 90, 99
+};
+
+/*
+ * What gets shown for a device, worked out from a snapshot of it.
+ */
+struct metrics_summary {
+	char ms_name[METRICS_NAME_LENGTH * 2];	/* Escaped for a label.  */
+	const char *ms_op;
+	size_t ms_queued;
+	uint64_t ms_ok;
+	uint64_t ms_failed;
+	const char *ms_error_stage;
+	int ms_error_fault;
+	uint64_t ms_error_time;
+	uint64_t ms_cpm;
+	size_t ms_count;
+	uint64_t ms_sum;
+	uint64_t ms_quantiles[METRICS_QUANTILES];
+};
+
+struct metrics {
+	pthread_mutex_t m_lock;
+	int m_fd;
+	int m_wakeup[2];
+	char m_path[sizeof ((struct sockaddr_un *)0)->sun_path];
+	pthread_t m_thread;
+	size_t m_ndevices;
+	struct metrics_device m_devices[METRICS_DEVICES];
+	struct metrics_device m_snapshot;
+	uint64_t m_sorted[METRICS_SAMPLES];
+	struct metrics_summary m_summaries[METRICS_DEVICES];
+	char m_buffer[METRICS_BUFFER_SIZE];
+};
+
+static int metrics_compare(const void *, const void *);
+static bool metrics_listen(struct metrics *, const char *);
+static void *metrics_main(void *);
+static uint64_t metrics_now(void);
+static size_t metrics_render(struct metrics *);
+static void metrics_summarize(struct metrics *, size_t, uint64_t);
+static void metrics_label(char *, size_t, const char *);
+static bool metrics_send(int, const char *, size_t, uint64_t);
+static void metrics_serve(struct metrics *, int);
+
+/*
+ * The address is either the path of a Unix socket, or a port number to
+ * listen on on the loopback address.
+ */
+struct metrics *
+metrics_create(const char *address)
+{
+	struct metrics *m;
+	int error;
+
+	m = calloc(1, sizeof *m);
+	if (m == NULL)
+		return (NULL);
+
+	m->m_fd = -1;
+	m->m_wakeup[0] = m->m_wakeup[1] = -1;
+	pthread_mutex_init(&m->m_lock, NULL);
+
+	if (!metrics_listen(m, address))
+		goto fail;
+
+	if (pipe(m->m_wakeup) == -1)
+		goto fail;
+
+	error = pthread_create(&m->m_thread, NULL, metrics_main, m);
+	if (error != 0) {
+		errno = error;
+		goto fail;
+	}
+	return (m);
+
+fail:
+	error = errno;
+	if (m->m_wakeup[0] != -1) {
+		close(m->m_wakeup[0]);
+		close(m->m_wakeup[1]);
+	}
+	if (m->m_fd != -1)
+		close(m->m_fd);
+	if (m->m_path[0] != '\0')
+		unlink(m->m_path);
+	pthread_mutex_destroy(&m->m_lock);
+	free(m);
+	errno = error;
+	return (NULL);
+}
+
+void
+metrics_free(struct metrics *m)
+{
+	size_t i;
+
+	(void)write(m->m_wakeup[1], "", 1);
+	pthread_join(m->m_thread, NULL);
+
+	close(m->m_wakeup[0]);
+	close(m->m_wakeup[1]);
+	close(m->m_fd);
+	if (m->m_path[0] != '\0')
+		unlink(m->m_path);
+
+	for (i = 0; i < m->m_ndevices; i++)
+		pthread_mutex_destroy(&m->m_devices[i].md_lock);
+	pthread_mutex_destroy(&m->m_lock);
+	free(m);
+}
+
+struct metrics_device *
+metrics_device(struct metrics *m, const char *name)
+{
+	struct metrics_device *md;
+
+	pthread_mutex_lock(&m->m_lock);
+	if (m->m_ndevices == METRICS_DEVICES) {
+		pthread_mutex_unlock(&m->m_lock);
+		return (NULL);
+	}
+	md = &m->m_devices[m->m_ndevices];
+	pthread_mutex_init(&md->md_lock, NULL);
+	strlcpy(md->md_name, name, sizeof md->md_name);
+	md->md_op = METRICS_OP_IDLE;
+	m->m_ndevices++;
+	pthread_mutex_unlock(&m->m_lock);
+
+	return (md);
+}
+
+void
+metrics_begin(struct metrics_device *md, const char *op)
+{
+	uint64_t now;
+
+	now = metrics_now();
+
+	pthread_mutex_lock(&md->md_lock);
+	md->md_op = op;
+	md->md_started = now;
+	pthread_mutex_unlock(&md->md_lock);
+}
+
+void
+metrics_end(struct metrics_device *md, bool ok)
+{
+	uint64_t now, second;
+	size_t slot;
+
+	now = metrics_now();
+	second = now / 1000000;
+
+	pthread_mutex_lock(&md->md_lock);
+	if (ok) {
+		slot = md->md_samples % METRICS_SAMPLES;
+		md->md_latencies[slot] = now - md->md_started;
+		md->md_samples++;
+		md->md_ok++;
+
+		/*
+		 * Completions are counted by the second, so that the rate
+		 * covers the whole window however many cards go through.
+		 */
+		slot = second % METRICS_WINDOW;
+		if (md->md_seconds[slot] != second) {
+			md->md_seconds[slot] = second;
+			md->md_completions[slot] = 0;
+		}
+		md->md_completions[slot]++;
+	} else {
+		md->md_failed++;
+	}
+	md->md_op = METRICS_OP_IDLE;
+	pthread_mutex_unlock(&md->md_lock);
+}
+
+/*
+ * The stage is kept by reference, so it should be a constant, such as
+ * ez_writer_stage_name gives.
+ */
+void
+metrics_error(struct metrics_device *md, const char *stage, int fault)
+{
+	uint64_t now;
+
+	now = metrics_now();
+
+	pthread_mutex_lock(&md->md_lock);
+	md->md_error_stage = stage;
+	md->md_error_fault = fault;
+	md->md_error_time = now;
+	pthread_mutex_unlock(&md->md_lock);
+}
+
+void
+metrics_queue(struct metrics_device *md, size_t queued)
+{
+	pthread_mutex_lock(&md->md_lock);
+	md->md_queued = queued;
+	pthread_mutex_unlock(&md->md_lock);
+}
+
+static int
+metrics_compare(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Copy a device name into a label value, escaping what the text format
+ * requires.  A name too long to fit is cut short.
+ */
+static void
+metrics_label(char *buf, size_t len, const char *name)
+{
+	size_t off;
+
+	for (off = 0; *name != '\0' && off + 2 < len; name++) {
+		switch (*name) {
+		case '\\':
+		case '"':
+			buf[off++] = '\\';
+			buf[off++] = *name;
+			break;
+		case '\n':
+			buf[off++] = '\\';
+			buf[off++] = 'n';
+			break;
+		default:
+			buf[off++] = *name;
+			break;
+		}
+	}
+	buf[off] = '\0';
+}
+
+static bool
+metrics_listen(struct metrics *m, const char *address)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct stat st;
+	unsigned long port;
+	char *end;
+	int on;
+
+	if (strchr(address, '/') != NULL) {
+		memset(&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		if (strlen(address) >= sizeof sun.sun_path) {
+			errno = ENAMETOOLONG;
+			return (false);
+		}
+		memcpy(sun.sun_path, address, strlen(address) + 1);
+
+		m->m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m->m_fd == -1)
+			return (false);
+
+		/*
+		 * A socket left behind by an earlier run would stop us
+		 * binding.  Anything else at that path is not ours to remove.
+		 */
+		if (lstat(address, &st) == 0) {
+			if (!S_ISSOCK(st.st_mode)) {
+				errno = EEXIST;
+				return (false);
+			}
+			(void)unlink(address);
+		}
+		if (bind(m->m_fd, (struct sockaddr *)&sun, sizeof sun) == -1)
+			return (false);
+		strlcpy(m->m_path, address, sizeof m->m_path);
+	} else {
+		port = strtoul(address, &end, 10);
+		if (*address == '\0' || *end != '\0' || port == 0 ||
+		    port > 65535) {
+			errno = EINVAL;
+			return (false);
+		}
+
+		memset(&sin, 0, sizeof sin);
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		m->m_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (m->m_fd == -1)
+			return (false);
+		on = 1;
+		(void)setsockopt(m->m_fd, SOL_SOCKET, SO_REUSEADDR, &on,
+				 sizeof on);
+		if (bind(m->m_fd, (struct sockaddr *)&sin, sizeof sin) == -1)
+			return (false);
+	}
+
+	(void)fcntl(m->m_fd, F_SETFD, FD_CLOEXEC);
+	return (listen(m->m_fd, 8) == 0);
+}
+
+static void *
+metrics_main(void *arg)
+{
+	struct pollfd pfd[2];
+	struct metrics *m;
+	int fd;
+
+	m = arg;
+
+	pfd[0].fd = m->m_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = m->m_wakeup[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[1].revents != 0)
+			break;
+		if (pfd[0].revents == 0)
+			continue;
+
+		fd = accept(m->m_fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+
+		/*
+		 * Do not let a scraper which stops reading hold us up, or
+		 * metrics_free waiting for us; see metrics_send.
+		 */
+		(void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef	SO_NOSIGPIPE
+		{
+			int on;
+
+			on = 1;
+			(void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on,
+					 sizeof on);
+		}
+#endif
+		metrics_serve(m, fd);
+		close(fd);
+	}
+
+	return (NULL);
+}
+
+static uint64_t
+metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static size_t
+metrics_render(struct metrics *m)
+{
+	struct metrics_summary *ms;
+	size_t i, q, ndevices, len, off;
+	char *buf;
+	uint64_t now;
+	int rv;
+
+	now = metrics_now();
+
+	pthread_mutex_lock(&m->m_lock);
+	ndevices = m->m_ndevices;
+	pthread_mutex_unlock(&m->m_lock);
+
+	/*
+	 * Devices are never removed, so those we counted stay put.
+	 */
+	for (i = 0; i < ndevices; i++)
+		metrics_summarize(m, i, now);
+
+	/*
+	 * Each metric has to be given for every device before moving on to
+	 * the next.  A page that would not fit is cut short at the last whole
+	 * line, rather than overflowing or failing outright.
+	 */
+	buf = m->m_buffer;
+	len = sizeof m->m_buffer;
+	off = 0;
+#define	METRICS_PRINT(...)						\
+	do {								\
+		rv = snprintf(buf + off, len - off, __VA_ARGS__);	\
+		if (rv < 0 || (size_t)rv >= len - off) {		\
+			buf[off] = '\0';				\
+			return (off);					\
+		}							\
+		off += rv;						\
+	} while (0)
+
+	METRICS_PRINT("# HELP idtmag_operation Operation each device is "
+		      "doing.\n# TYPE idtmag_operation gauge\n");
+	for (i = 0, ms = m->m_summaries; i < ndevices; i++, ms++)
+		METRICS_PRINT("idtmag_operation{device=\"%s\",op=\"%s\"} 1\n",
+			      ms->ms_name, ms->ms_op);
+
+	METRICS_PRINT("# HELP idtmag_queue_depth Jobs waiting for each "
+		      "device.\n# TYPE idtmag_queue_depth gauge\n");
+	for (i = 0, ms = m->m_summaries; i < ndevices; i++, ms++)
+		METRICS_PRINT("idtmag_queue_depth{device=\"%s\"} %zu\n",
+			      ms->ms_name, ms->ms_queued);
+
+	METRICS_PRINT("# HELP idtmag_cards_per_minute Cards done in the last "
+		      "minute.\n# TYPE idtmag_cards_per_minute gauge\n");
+	for (i = 0, ms = m->m_summaries; i < ndevices; i++, ms++)
+		METRICS_PRINT("idtmag_cards_per_minute{device=\"%s\"} %ju\n",
+			      ms->ms_name, (uintmax_t)ms->ms_cpm);
+
+	METRICS_PRINT("# HELP idtmag_operations_total Operations finished, by "
+		      "result.\n# TYPE idtmag_operations_total counter\n");
+	for (i = 0, ms = m->m_summaries; i < ndevices; i++, ms++) {
+		METRICS_PRINT("idtmag_operations_total{device=\"%s\","
+			      "result=\"ok\"} %ju\n", ms->ms_name,
+			      (uintmax_t)ms->ms_ok);
+		METRICS_PRINT("idtmag_operations_total{device=\"%s\","
+			      "result=\"error\"} %ju\n", ms->ms_name,
+			      (uintmax_t)ms->ms_failed);
+	}
+
+	METRICS_PRINT("# HELP idtmag_last_error_age_seconds Time since the "
+		      "last error.\n"
+		      "# TYPE idtmag_last_error_age_seconds gauge\n");
+	for (i = 0, ms = m->m_summaries; i < ndevices; i++, ms++) {
+		if (ms->ms_error_time == 0)
+			continue;
+		METRICS_PRINT("idtmag_last_error_age_seconds{device=\"%s\","
+			      "stage=\"%s\",fault=\"%d\"} %.3f\n",
+			      ms->ms_name, ms->ms_error_stage,
+			      ms->ms_error_fault,
+			      (now - ms->ms_error_time) / 1e6);
+	}
+
+	METRICS_PRINT("# HELP idtmag_latency_seconds Recent operation "
+		      "latencies.\n# TYPE idtmag_latency_seconds summary\n");
+	for (i = 0, ms = m->m_summaries; i < ndevices; i++, ms++) {
+		if (ms->ms_count == 0)
+			continue;
+		for (q = 0; q < METRICS_QUANTILES; q++)
+			METRICS_PRINT("idtmag_latency_seconds{device=\"%s\","
+				      "quantile=\"0.%02u\"} %.6f\n",
+				      ms->ms_name, metrics_quantiles[q],
+				      ms->ms_quantiles[q] / 1e6);
+		METRICS_PRINT("idtmag_latency_seconds_sum{device=\"%s\"} "
+			      "%.6f\n", ms->ms_name, ms->ms_sum / 1e6);
+		METRICS_PRINT("idtmag_latency_seconds_count{device=\"%s\"} "
+			      "%zu\n", ms->ms_name, ms->ms_count);
+	}
+#undef	METRICS_PRINT
+
+	return (off);
+}
+
+static void
+metrics_serve(struct metrics *m, int fd)
+{
+	static const char response[] =
+	    "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Connection: close\r\n"
+	    "\r\n";
+	struct pollfd pfd;
+	char request[1024];
+	uint64_t deadline;
+	size_t len;
+
+	/*
+	 * There is only one page, so all we need from the request is for it
+	 * to have been sent; read what there is and answer.  Someone who
+	 * connects and says nothing gets a page anyway once we stop waiting.
+	 */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) == 1)
+		(void)read(fd, request, sizeof request);
+
+	len = metrics_render(m);
+
+	deadline = metrics_now() + METRICS_RESPONSE_TIMEOUT * 1000;
+	if (metrics_send(fd, response, sizeof response - 1, deadline))
+		(void)metrics_send(fd, m->m_buffer, len, deadline);
+}
+
+/*
+ * Send on a non-blocking socket, giving up at the deadline, which covers the
+ * whole response: a scraper reading a byte at a time must not be able to
+ * keep us for a timeout per send.
+ */
+static bool
+metrics_send(int fd, const char *buf, size_t len, uint64_t deadline)
+{
+	struct pollfd pfd;
+	uint64_t now;
+	ssize_t rv;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+
+	while (len != 0) {
+		rv = send(fd, buf, len, METRICS_SEND_FLAGS);
+		if (rv > 0) {
+			buf += rv;
+			len -= rv;
+			continue;
+		}
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return (false);
+
+		now = metrics_now();
+		if (now >= deadline)
+			return (false);
+		if (poll(&pfd, 1, (deadline - now + 999) / 1000) == -1 &&
+		    errno != EINTR)
+			return (false);
+	}
+	return (true);
+}
+
+static void
+metrics_summarize(struct metrics *m, size_t device, uint64_t now)
+{
+	struct metrics_device *md, *snap;
+	struct metrics_summary *ms;
+	size_t i, n;
+
+	md = &m->m_devices[device];
+	ms = &m->m_summaries[device];
+	snap = &m->m_snapshot;
+
+	/*
+	 * Copy the device out and let it go before doing anything slow.
+	 */
+	pthread_mutex_lock(&md->md_lock);
+	memcpy(snap->md_name, md->md_name, sizeof md->md_name);
+	snap->md_op = md->md_op;
+	snap->md_queued = md->md_queued;
+	snap->md_ok = md->md_ok;
+	snap->md_failed = md->md_failed;
+	snap->md_error_stage = md->md_error_stage;
+	snap->md_error_fault = md->md_error_fault;
+	snap->md_error_time = md->md_error_time;
+	memcpy(snap->md_latencies, md->md_latencies, sizeof md->md_latencies);
+	snap->md_samples = md->md_samples;
+	memcpy(snap->md_seconds, md->md_seconds, sizeof md->md_seconds);
+	memcpy(snap->md_completions, md->md_completions,
+	       sizeof md->md_completions);
+	pthread_mutex_unlock(&md->md_lock);
+
+	metrics_label(ms->ms_name, sizeof ms->ms_name, snap->md_name);
+	ms->ms_op = snap->md_op;
+	ms->ms_queued = snap->md_queued;
+	ms->ms_ok = snap->md_ok;
+	ms->ms_failed = snap->md_failed;
+	ms->ms_error_stage = snap->md_error_stage;
+	ms->ms_error_fault = snap->md_error_fault;
+	ms->ms_error_time = snap->md_error_time;
+
+	ms->ms_cpm = 0;
+	for (i = 0; i < METRICS_WINDOW; i++) {
+		if (now / 1000000 - snap->md_seconds[i] < METRICS_WINDOW)
+			ms->ms_cpm += snap->md_completions[i];
+	}
+
+	n = snap->md_samples < METRICS_SAMPLES ? snap->md_samples :
+	    METRICS_SAMPLES;
+	ms->ms_sum = 0;
+	for (i = 0; i < n; i++) {
+		m->m_sorted[i] = snap->md_latencies[i];
+		ms->ms_sum += snap->md_latencies[i];
+	}
+	ms->ms_count = n;
+
+	if (n == 0)
+		return;
+	qsort(m->m_sorted, n, sizeof m->m_sorted[0], metrics_compare);
+	for (i = 0; i < METRICS_QUANTILES; i++)
+		ms->ms_quantiles[i] = m->m_sorted[(n - 1) * metrics_quantiles[i] / 100];
+}
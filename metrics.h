@@ -0,0 +1,22 @@
+#ifndef	METRICS_H
+#define	METRICS_H
+
+struct metrics;
+struct metrics_device;
+
+#define	METRICS_OP_IDLE		("idle")
+#define	METRICS_OP_READ		("read")
+#define	METRICS_OP_WRITE	("write")
+#define	METRICS_OP_ERASE	("erase")
+
+struct metrics *metrics_create(const char *);
+void metrics_free(struct metrics *);
+
+struct metrics_device *metrics_device(struct metrics *, const char *);
+
+void metrics_begin(struct metrics_device *, const char *);
+void metrics_end(struct metrics_device *, bool);
+void metrics_error(struct metrics_device *, const char *, int);
+void metrics_queue(struct metrics_device *, size_t);
+
+#endif /* !METRICS_H */
@@ -0,0 +1,154 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "card_data.h"
+#include "card_index.h"
+
+/*
+ * Round-trip the card index through its snapshot: create, add, save, reload,
+ * then add to the reloaded index and save it again both without and with the
+ * table growing, checking what is found at each step.
+ */
+
+#define	CARDS	(2000)
+
+static void card(struct card_data *, unsigned);
+static void check(struct card_index *, unsigned, unsigned);
+
+int
+main(void)
+{
+	char path[] = "/tmp/card_index_test.XXXXXX";
+	struct card_index *ci;
+	struct card_data cdata;
+	struct stat st;
+	unsigned i;
+	ino_t ino;
+	off_t size;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		err(1, "mkstemp");
+	close(fd);
+	unlink(path);
+
+	if (card_index_load(path, false) != NULL || errno != ENOENT)
+		errx(1, "loaded an index that does not exist");
+
+	ci = card_index_create(0, true);
+	if (ci == NULL)
+		err(1, "card_index_create");
+	card(&cdata, 0);
+	if (!card_index_add(ci, &cdata) || card_index_add(ci, &cdata))
+		errx(1, "duplicate not detected");
+	card(&cdata, 1);
+	card_index_add(ci, &cdata);
+	check(ci, 2, 4);
+	if (!card_index_save(ci, path))
+		err(1, "card_index_save");
+	card_index_free(ci);
+
+	/*
+	 * Reload, with and without the Bloom filter.
+	 */
+	ci = card_index_load(path, true);
+	if (ci == NULL)
+		err(1, "card_index_load");
+	check(ci, 2, 4);
+	card_index_free(ci);
+
+	ci = card_index_load(path, false);
+	if (ci == NULL)
+		err(1, "card_index_load");
+	check(ci, 2, 4);
+
+	/*
+	 * Add one more card; saving that should write into the file in place
+	 * rather than replace it.
+	 */
+	if (stat(path, &st) == -1)
+		err(1, "stat");
+	ino = st.st_ino;
+	size = st.st_size;
+	card(&cdata, 2);
+	card_index_add(ci, &cdata);
+	if (!card_index_save(ci, path))
+		err(1, "card_index_save");
+	card_index_free(ci);
+	if (stat(path, &st) == -1)
+		err(1, "stat");
+	if (st.st_ino != ino || st.st_size != size)
+		errx(1, "snapshot was rewritten without growing");
+
+	ci = card_index_load(path, false);
+	if (ci == NULL)
+		err(1, "card_index_load");
+	check(ci, 3, 6);
+
+	/*
+	 * Now enough to make the table grow, which writes it out whole.
+	 */
+	for (i = 3; i < CARDS; i++) {
+		card(&cdata, i);
+		if (!card_index_add(ci, &cdata))
+			errx(1, "card %u already present", i);
+	}
+	if (!card_index_save(ci, path))
+		err(1, "card_index_save");
+	card_index_free(ci);
+
+	ci = card_index_load(path, true);
+	if (ci == NULL)
+		err(1, "card_index_load");
+	check(ci, CARDS, CARDS * 2);
+	card_index_free(ci);
+
+	/*
+	 * A file that is not an index is refused.
+	 */
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		err(1, "open");
+	if (write(fd, "not an index, not at all", 24) != 24)
+		err(1, "write");
+	close(fd);
+	if (card_index_load(path, false) != NULL || errno != EINVAL)
+		errx(1, "loaded a corrupt index");
+
+	unlink(path);
+	return (0);
+}
+
+static void
+card(struct card_data *cdata, unsigned n)
+{
+	memset(cdata, 0, sizeof *cdata);
+	snprintf(cdata->cd_track2, sizeof cdata->cd_track2, "%016u=0000", n);
+}
+
+static void
+check(struct card_index *ci, unsigned count, unsigned limit)
+{
+	struct card_data cdata;
+	unsigned i;
+
+	if (card_index_count(ci) != count)
+		errx(1, "expected %u cards, found %zu", count,
+		     card_index_count(ci));
+	for (i = 0; i < limit; i++) {
+		card(&cdata, i);
+		if (card_index_contains(ci, &cdata) != (i < count))
+			errx(1, "card %u %s", i,
+			     i < count ? "missing" : "present");
+	}
+}
@@ -0,0 +1,96 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "device_lease.h"
+
+/*
+ * Every name for the same device has to come to the same lease: with or
+ * without /dev, and through a symlink.  flock locks belong to the open file,
+ * so a second attempt from this process conflicts just as another process's
+ * would.
+ */
+
+static void conflict(const char *, const char *);
+
+int
+main(void)
+{
+	char dir[] = "/tmp/device_lease_test.XXXXXX";
+	char alias[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	struct device_lease *dl, *other;
+	const char *names[2];
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(alias, sizeof alias, "%s/device", dir);
+	if (symlink("/dev/null", alias) == -1)
+		err(1, "symlink");
+
+	dl = device_lease_acquire(dir, "null", false);
+	if (dl == NULL)
+		err(1, "device_lease_acquire");
+	if (device_lease_holder(dir, "/dev/null") != getpid())
+		errx(1, "holder not found by full path");
+	conflict(dir, "/dev/null");
+	conflict(dir, alias);
+	conflict(dir, "null");
+	device_lease_release(dl);
+
+	dl = device_lease_acquire(dir, alias, false);
+	if (dl == NULL)
+		err(1, "device_lease_acquire");
+	if (strcmp(device_lease_device(dl), alias) != 0)
+		errx(1, "lease does not keep the name it was given");
+	conflict(dir, "null");
+	device_lease_release(dl);
+
+	/*
+	 * With one device taken, acquiring any must give the other.
+	 */
+	names[0] = "/dev/null";
+	names[1] = "/dev/zero";
+	dl = device_lease_acquire(dir, "null", false);
+	if (dl == NULL)
+		err(1, "device_lease_acquire");
+	other = device_lease_acquire_any(dir, names, 2, false);
+	if (other == NULL)
+		err(1, "device_lease_acquire_any");
+	if (strcmp(device_lease_device(other), "/dev/zero") != 0)
+		errx(1, "acquired %s, which is taken", device_lease_device(other));
+	if (device_lease_acquire_any(dir, names, 2, false) != NULL ||
+	    errno != EWOULDBLOCK)
+		errx(1, "acquired a device twice");
+	device_lease_release(other);
+	device_lease_release(dl);
+
+	if (device_lease_holder(dir, "null") != 0)
+		errx(1, "lease still held after release");
+
+	snprintf(path, sizeof path, "%s/null.lock", dir);
+	unlink(path);
+	snprintf(path, sizeof path, "%s/zero.lock", dir);
+	unlink(path);
+	unlink(alias);
+	rmdir(dir);
+	return (0);
+}
+
+static void
+conflict(const char *dir, const char *device)
+{
+	struct device_lease *dl;
+
+	dl = device_lease_acquire(dir, device, false);
+	if (dl != NULL)
+		errx(1, "%s leased while held under another name", device);
+	if (errno != EWOULDBLOCK)
+		err(1, "device_lease_acquire %s", device);
+}
@@ -0,0 +1,265 @@
+#ifdef	__linux__
+#define	_GNU_SOURCE	/* For posix_openpt.  */
+#endif
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*
+ * A simulated EZ Writer on a pseudo-terminal, for recording the transcripts in
+ * this directory without a device or anyone to swipe cards.  It prints the
+ * name of the terminal to open, then answers commands on it until killed or
+ * until it has been idle for a minute.
+ *
+ *	-s speed	Only answer at this line speed, as a device which has
+ *			been switched to it would; anything sent at another
+ *			rate is garbage and goes unanswered.
+ *	-f		Refuse the first write with a bad status, and garble
+ *			the response to the first read, to record recovery.
+ *
+ * Every card swiped for a read holds the same tracks, with track 3 empty.
+ */
+
+#define	EZSIM_ESCAPE		('\033')
+#define	EZSIM_IDLE		(60)		/* Seconds.  */
+#define	EZSIM_SWIPE		(200000)	/* Microseconds.  */
+#define	EZSIM_SPLIT		(10000)		/* Microseconds.  */
+
+static const char ezsim_version[] = "EZ Writer Simulator Version 1.00        ";
+
+static const char ezsim_card[] =
+	"\033s"
+	"\033\001%B4111111111111111^TEST/CARD^2512?"
+	"\033\002;4111111111111111=2512?"
+	"\033\003\033*"
+	"?\034"
+	"\0330";
+
+static const struct ezsim_speed {
+	unsigned es_rate;
+	speed_t es_speed;
+} ezsim_speeds[] = {
+	{ 9600,		B9600 },
+	{ 19200,	B19200 },
+	{ 38400,	B38400 },
+	{ 57600,	B57600 },
+	{ 115200,	B115200 },
+};
+
+static int ezsim_master;
+static int ezsim_slave;
+
+static size_t ezsim_command(const char *, size_t, bool *, bool *);
+static unsigned ezsim_rate(void);
+static void ezsim_send(const char *, size_t);
+
+int
+main(int argc, char *argv[])
+{
+	char buf[1024];
+	struct timeval tv;
+	fd_set fds;
+	unsigned speed;
+	size_t len, used;
+	bool badread, badwrite;
+	ssize_t rv;
+	char *end;
+	int ch;
+
+	speed = 0;
+	badread = badwrite = false;
+
+	while ((ch = getopt(argc, argv, "fs:")) != -1) {
+		switch (ch) {
+		case 'f':
+			badread = badwrite = true;
+			break;
+		case 's':
+			speed = strtoul(optarg, &end, 10);
+			if (*end != '\0')
+				errx(1, "invalid speed: %s", optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: ezsim [-f] [-s speed]\n");
+			return (1);
+		}
+	}
+
+	ezsim_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (ezsim_master == -1 || grantpt(ezsim_master) == -1 ||
+	    unlockpt(ezsim_master) == -1)
+		err(1, "posix_openpt");
+
+	/*
+	 * Keep the terminal open ourselves, both to see what rate it has been
+	 * set to and so that it stays usable between clients.
+	 */
+	ezsim_slave = open(ptsname(ezsim_master), O_RDWR | O_NOCTTY);
+	if (ezsim_slave == -1)
+		err(1, "open");
+
+	printf("%s\n", ptsname(ezsim_master));
+	fflush(stdout);
+
+	len = 0;
+	for (;;) {
+		FD_ZERO(&fds);
+		FD_SET(ezsim_master, &fds);
+		tv.tv_sec = EZSIM_IDLE;
+		tv.tv_usec = 0;
+		rv = select(ezsim_master + 1, &fds, NULL, NULL, &tv);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "select");
+		}
+		if (rv == 0)
+			return (0);
+
+		rv = read(ezsim_master, buf + len, sizeof buf - len);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "read");
+		}
+		len += rv;
+
+		if (speed != 0 && ezsim_rate() != speed) {
+			len = 0;
+			continue;
+		}
+
+		while (len != 0) {
+			used = ezsim_command(buf, len, &badread, &badwrite);
+			if (used == 0)
+				break;
+			memmove(buf, buf + used, len - used);
+			len -= used;
+		}
+
+		/*
+		 * Nothing we understand is this long; throw it away rather
+		 * than wedge.
+		 */
+		if (len == sizeof buf)
+			len = 0;
+	}
+}
+
+/*
+ * Answer the command at the start of buf, returning how many bytes it took,
+ * or 0 if it is not all there yet.
+ */
+static size_t
+ezsim_command(const char *buf, size_t len, bool *badread, bool *badwrite)
+{
+	const char *p;
+
+	if (buf[0] == '9') {
+		ezsim_send("\0334", 2);
+		return (1);
+	}
+	if (buf[0] != EZSIM_ESCAPE)
+		return (1);
+	if (len < 2)
+		return (0);
+
+	switch (buf[1]) {
+	case 'a':
+		return (2);
+	case 'e':
+		ezsim_send("\033y", 2);
+		return (2);
+	case '\207':
+		ezsim_send("\0330", 2);
+		return (2);
+	case 'u':
+		ezsim_send(ezsim_version, sizeof ezsim_version - 1);
+		return (2);
+	case 'x':
+	case 'y':
+		ezsim_send("\0330", 2);
+		return (2);
+	case 'r':
+		usleep(EZSIM_SWIPE);
+		if (*badread) {
+			*badread = false;
+			ezsim_send("\033X", 2);
+			return (2);
+		}
+		/*
+		 * Split the card up, so that it does not all come back in one
+		 * read.
+		 */
+		ezsim_send(ezsim_card, 10);
+		usleep(EZSIM_SPLIT);
+		ezsim_send(ezsim_card + 10, sizeof ezsim_card - 1 - 10);
+		return (2);
+	case 'c':
+		if (len < 3)
+			return (0);
+		usleep(EZSIM_SWIPE);
+		ezsim_send("\0330", 2);
+		return (3);
+	case 'w':
+		for (p = buf + 2; p + 1 < buf + len; p++) {
+			if (p[0] == '?' && p[1] == '\034')
+				break;
+		}
+		if (p + 1 >= buf + len)
+			return (0);
+		usleep(EZSIM_SWIPE);
+		if (*badwrite) {
+			*badwrite = false;
+			ezsim_send("\0331", 2);
+		} else {
+			ezsim_send("\0330", 2);
+		}
+		return (p + 2 - buf);
+	default:
+		return (1);
+	}
+}
+
+static unsigned
+ezsim_rate(void)
+{
+	struct termios control;
+	speed_t ospeed;
+	size_t i;
+
+	if (tcgetattr(ezsim_slave, &control) == -1)
+		err(1, "tcgetattr");
+	ospeed = cfgetospeed(&control);
+	for (i = 0; i < sizeof ezsim_speeds / sizeof ezsim_speeds[0]; i++) {
+		if (ezsim_speeds[i].es_speed == ospeed)
+			return (ezsim_speeds[i].es_rate);
+	}
+	return (0);
+}
+
+static void
+ezsim_send(const char *buf, size_t len)
+{
+	ssize_t rv;
+
+	for (; len != 0; buf += rv, len -= rv) {
+		rv = write(ezsim_master, buf, len);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+			err(1, "write");
+		}
+	}
+}
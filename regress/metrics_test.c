@@ -0,0 +1,153 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+ * Scrape the metrics page over a Unix socket and check what is on it: names
+ * which need escaping, a rate of completions well beyond the latency samples
+ * kept, and that a scraper which never reads does not hold up the next one.
+ */
+
+#define	CARDS	(500)
+
+static void expect(const char *, const char *);
+static size_t scrape(const char *, char *, size_t);
+
+int
+main(void)
+{
+	char path[] = "/tmp/metrics_test.XXXXXX";
+	char sock[sizeof path + sizeof "/metrics"];
+	struct sockaddr_un sun;
+	struct metrics_device *md;
+	struct metrics *m;
+	struct timespec start, end;
+	char page[65536];
+	unsigned i;
+	int fd;
+
+	if (mkdtemp(path) == NULL)
+		err(1, "mkdtemp");
+	snprintf(sock, sizeof sock, "%s/metrics", path);
+
+	/*
+	 * Something at the path which is not a socket is left alone.
+	 */
+	fd = creat(sock, 0644);
+	if (fd == -1)
+		err(1, "creat");
+	close(fd);
+	if (metrics_create(sock) != NULL || errno != EEXIST)
+		errx(1, "metrics_create replaced a file");
+	unlink(sock);
+
+	m = metrics_create(sock);
+	if (m == NULL)
+		err(1, "metrics_create");
+	md = metrics_device(m, "tty\"USB\\0\n");
+	if (md == NULL)
+		err(1, "metrics_device");
+
+	for (i = 0; i < CARDS; i++) {
+		metrics_begin(md, METRICS_OP_WRITE);
+		metrics_end(md, true);
+	}
+	metrics_begin(md, METRICS_OP_READ);
+	metrics_end(md, false);
+	metrics_error(md, "read", 3);
+	metrics_queue(md, 7);
+	metrics_begin(md, METRICS_OP_ERASE);
+
+	scrape(sock, page, sizeof page);
+	expect(page, "idtmag_operation{device=\"tty\\\"USB\\\\0\\n\","
+	       "op=\"erase\"} 1\n");
+	expect(page, "idtmag_queue_depth{device=\"tty\\\"USB\\\\0\\n\"} 7\n");
+	expect(page, "idtmag_cards_per_minute{device=\"tty\\\"USB\\\\0\\n\"} "
+	       "500\n");
+	expect(page, "idtmag_operations_total{device=\"tty\\\"USB\\\\0\\n\","
+	       "result=\"error\"} 1\n");
+	expect(page, "idtmag_latency_seconds_count{device=\"tty\\\"USB\\\\0\\n\"} "
+	       "128\n");
+
+	/*
+	 * Connect and never read a thing.  The page is small enough to fit
+	 * in the socket buffer, so this mostly checks that the server goes on
+	 * to the next scraper at all.
+	 */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		err(1, "socket");
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, sock, strlen(sock) + 1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1)
+		err(1, "connect");
+	if (write(fd, "GET / HTTP/1.0\r\n\r\n", 18) != 18)
+		err(1, "write");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	scrape(sock, page, sizeof page);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (end.tv_sec - start.tv_sec > 3)
+		errx(1, "scrape held up by an earlier one");
+	close(fd);
+
+	metrics_free(m);
+	if (access(sock, F_OK) == 0)
+		errx(1, "socket left behind");
+	rmdir(path);
+	return (0);
+}
+
+static void
+expect(const char *page, const char *line)
+{
+	if (strstr(page, line) == NULL)
+		errx(1, "missing from page: %s\n%s", line, page);
+}
+
+static size_t
+scrape(const char *sock, char *page, size_t len)
+{
+	struct sockaddr_un sun;
+	size_t off;
+	ssize_t rv;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		err(1, "socket");
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, sock, strlen(sock) + 1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1)
+		err(1, "connect");
+	if (write(fd, "GET /metrics HTTP/1.0\r\n\r\n", 25) != 25)
+		err(1, "write");
+
+	for (off = 0; off < len - 1; off += rv) {
+		rv = read(fd, page + off, len - 1 - off);
+		if (rv == -1)
+			err(1, "read");
+		if (rv == 0)
+			break;
+	}
+	page[off] = '\0';
+	close(fd);
+
+	if (strncmp(page, "HTTP/1.0 200 OK\r\n", 17) != 0)
+		errx(1, "bad response:\n%s", page);
+	return (off);
+}
@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Record the transcripts in this directory afresh against ezsim.  Run from the
+# directory idt_test, replay_test and ezsim were built in, with this directory
+# as the argument; make regress-record does that.
+#
+
+set -e
+
+dir=$1
+if [ -z "${dir}" ]; then
+	echo "usage: record.sh dir" >&2
+	exit 1
+fi
+
+start_sim() {
+	./ezsim "$@" > ezsim.tty &
+	sim=$!
+	while [ ! -s ezsim.tty ]; do
+		sleep 1
+	done
+	tty=$(cat ezsim.tty)
+}
+
+stop_sim() {
+	kill ${sim}
+	wait ${sim} || true
+	rm -f ezsim.tty
+}
+
+# Put a comment on top of a transcript saying what it is.
+note() {
+	file=$1
+	shift
+	{ printf '# %s\n' "$@"; cat "${file}"; } > "${file}.tmp"
+	mv "${file}.tmp" "${file}"
+}
+
+start_sim
+./replay_test -T ${tty} -s initialize_read ${dir}
+note ${dir}/initialize_read.txt \
+    "Initialize, version and read of one card, as idt_test -r does it," \
+    "recorded against ezsim."
+./replay_test -T ${tty} -s write_erase ${dir}
+note ${dir}/write_erase.txt \
+    "Initialize, then erase and write all three tracks at high coercivity," \
+    "recorded against ezsim."
+stop_sim
+
+start_sim -f
+./replay_test -T ${tty} -s recover ${dir}
+note ${dir}/recover.txt \
+    "A write refused with a bad status and recovered by resetting the" \
+    "buffer, then a garbled read recovered by a reset, a flush and a" \
+    "presence check.  Recorded against ezsim -f."
+stop_sim
+
+start_sim -s 57600
+rm -f speeds.record
+./idt_test -T ${dir}/negotiate.txt -b auto -S speeds.record ${tty} \
+    > /dev/null
+note ${dir}/negotiate.txt \
+    "-b auto with nothing cached: 115200 goes unanswered, 57600 answers." \
+    "Recorded with idt_test -T against ezsim -s 57600."
+./idt_test -T ${dir}/negotiate_cached.txt -b auto -S speeds.record ${tty} \
+    > /dev/null
+note ${dir}/negotiate_cached.txt \
+    "-b auto with 57600 cached for the device: no probing at other rates." \
+    "Recorded with idt_test -T against ezsim -s 57600."
+rm -f speeds.record
+stop_sim
@@ -0,0 +1,229 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "card_data.h"
+#include "ez_writer.h"
+#include "serial.h"
+#include "serial_replay.h"
+
+/*
+ * Play each recorded session in a directory back against the protocol code,
+ * many times over with time compressed, checking that every run sends exactly
+ * what was recorded and gets the expected result, and that the whole lot goes
+ * fast enough to run on every change.
+ *
+ * With -T, record the sessions instead, against a device or ezsim; see
+ * record.sh.  With -s, only the named session is played or recorded.
+ */
+
+#define	REPLAY_ROUNDS		(1000)
+#define	REPLAY_MIN_RATE		(1000)	/* Sessions per second.  */
+
+struct replay_session {
+	const char *rs_name;
+	bool (*rs_run)(struct serial_port *);
+};
+
+static void replay_card(struct card_data *);
+static bool replay_initialize_read(struct serial_port *);
+static void replay_record(const char *, const char *, const struct replay_session *);
+static bool replay_recover(struct serial_port *);
+static unsigned long replay_run(const char *, const struct replay_session *);
+static bool replay_write_erase(struct serial_port *);
+
+static const struct replay_session replay_sessions[] = {
+	{ "initialize_read",	replay_initialize_read },
+	{ "write_erase",	replay_write_erase },
+	{ "recover",		replay_recover },
+};
+
+int
+main(int argc, char *argv[])
+{
+	const struct replay_session *rs;
+	struct timespec start, end;
+	const char *device;
+	const char *name;
+	unsigned long sessions;
+	double elapsed;
+	size_t i;
+	int ch;
+
+	device = NULL;
+	name = NULL;
+
+	while ((ch = getopt(argc, argv, "s:T:")) != -1) {
+		switch (ch) {
+		case 's':
+			name = optarg;
+			break;
+		case 'T':
+			device = optarg;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: replay_test [-s session] [-T device] dir\n");
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		fprintf(stderr,
+			"usage: replay_test [-s session] [-T device] dir\n");
+		return (1);
+	}
+
+	sessions = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sizeof replay_sessions / sizeof replay_sessions[0];
+	     i++) {
+		rs = &replay_sessions[i];
+		if (name != NULL && strcmp(name, rs->rs_name) != 0)
+			continue;
+		if (device != NULL)
+			replay_record(device, argv[0], rs);
+		else
+			sessions += replay_run(argv[0], rs);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (device != NULL)
+		return (0);
+	if (sessions == 0)
+		errx(1, "no such session: %s", name);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%lu sessions in %.3fs, %.0f per second\n", sessions, elapsed,
+	       sessions / elapsed);
+	if (sessions / elapsed < REPLAY_MIN_RATE)
+		errx(1, "replay slower than %u sessions per second",
+		     REPLAY_MIN_RATE);
+	return (0);
+}
+
+static void
+replay_card(struct card_data *cdata)
+{
+	memset(cdata, 0, sizeof *cdata);
+	strcpy(cdata->cd_track1, "%B4111111111111111^TEST/CARD^2512?");
+	strcpy(cdata->cd_track2, ";4111111111111111=2512?");
+}
+
+/*
+ * What idt_test -r does.
+ */
+static bool
+replay_initialize_read(struct serial_port *sport)
+{
+	char version[EZ_WRITER_VERSION_LENGTH + 1];
+	struct card_data cdata, expected;
+
+	if (!ez_writer_initialize(sport) ||
+	    !ez_writer_version(sport, version, sizeof version) ||
+	    !ez_writer_read(sport, &cdata))
+		return (false);
+
+	replay_card(&expected);
+	return (memcmp(&cdata, &expected, sizeof cdata) == 0);
+}
+
+static void
+replay_record(const char *device, const char *dir, const struct replay_session *rs)
+{
+	char path[MAXPATHLEN];
+	struct serial_port sport;
+
+	snprintf(path, sizeof path, "%s/%s.txt", dir, rs->rs_name);
+	if (!serial_port_open(&sport, device))
+		err(1, "%s", device);
+	if (!serial_port_record(&sport, path))
+		err(1, "%s", path);
+	if (!rs->rs_run(&sport))
+		errx(1, "%s: session failed in stage %s", rs->rs_name,
+		     ez_writer_stage_name(sport.sp_error.spe_stage));
+	serial_port_close(&sport);
+}
+
+/*
+ * A write turned away with a bad status, which only needs the buffer reset,
+ * then a read that makes no sense, which needs everything.
+ */
+static bool
+replay_recover(struct serial_port *sport)
+{
+	struct card_data cdata;
+
+	if (!ez_writer_initialize(sport))
+		return (false);
+
+	replay_card(&cdata);
+	if (ez_writer_write_tracks(sport, true, EZ_WRITER_TRACK_MASK, &cdata,
+				   NULL) ||
+	    sport->sp_error.spe_fault != SERIAL_PORT_FAULT_STATUS ||
+	    !sport->sp_error.spe_sync)
+		return (false);
+	if (!ez_writer_recover(sport) ||
+	    !ez_writer_write_tracks(sport, true, EZ_WRITER_TRACK_MASK, &cdata,
+				    NULL))
+		return (false);
+
+	if (ez_writer_read(sport, &cdata) ||
+	    sport->sp_error.spe_fault != SERIAL_PORT_FAULT_FRAMING ||
+	    sport->sp_error.spe_sync)
+		return (false);
+	return (ez_writer_recover(sport) && ez_writer_read(sport, &cdata));
+}
+
+static unsigned long
+replay_run(const char *dir, const struct replay_session *rs)
+{
+	char path[MAXPATHLEN];
+	struct serial_transcript *st;
+	struct serial_port sport;
+	unsigned long i;
+
+	snprintf(path, sizeof path, "%s/%s.txt", dir, rs->rs_name);
+	st = serial_transcript_load(path);
+	if (st == NULL)
+		err(1, "%s", path);
+
+	for (i = 0; i < REPLAY_ROUNDS; i++) {
+		if (!serial_port_open_replay(&sport, st, true))
+			err(1, "serial_port_open_replay");
+		if (!rs->rs_run(&sport))
+			errx(1, "%s: session failed in stage %s", rs->rs_name,
+			     ez_writer_stage_name(sport.sp_error.spe_stage));
+		if (!serial_replay_finished(sport.sp_replay))
+			errx(1, "%s: session did not match the transcript",
+			     rs->rs_name);
+		serial_port_close(&sport);
+	}
+
+	serial_transcript_free(st);
+	return (i);
+}
+
+static bool
+replay_write_erase(struct serial_port *sport)
+{
+	struct card_data cdata;
+
+	replay_card(&cdata);
+	return (ez_writer_initialize(sport) &&
+		ez_writer_coercivity(sport, true) &&
+		ez_writer_erase(sport, EZ_WRITER_TRACK_MASK) &&
+		ez_writer_write_tracks(sport, true, EZ_WRITER_TRACK_MASK,
+				       &cdata, NULL));
+}
@@ -0,0 +1,148 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+/*
+ * Check the scheduler's arguments, and that jobs go where the learned cycle
+ * times say they will be done soonest.
+ */
+
+#define	SECOND	(1000000)
+
+static void aborts(struct scheduler *, bool, int);
+static void check(bool, const char *);
+
+int
+main(void)
+{
+	struct scheduler *s;
+	unsigned i;
+	bool hico;
+	void *arg;
+	int op;
+
+	errno = 0;
+	check(scheduler_create(0) == NULL && errno == EINVAL,
+	      "scheduler_create(0) did not fail with EINVAL");
+
+	s = scheduler_create(2);
+	if (s == NULL)
+		err(1, "scheduler_create");
+
+	aborts(s, true, -1);
+	aborts(s, true, SCHEDULER_OPS);
+	aborts(s, false, -1);
+	aborts(s, false, SCHEDULER_OPS);
+
+	/*
+	 * Station 0 writes a card in a second, station 1 in three.  The first
+	 * three jobs all finish soonest at station 0; a tie goes to the lower
+	 * station.  Only the fourth is better off at station 1.
+	 */
+	scheduler_record(s, 0, SCHEDULER_OP_WRITE, false, 1 * SECOND);
+	scheduler_record(s, 1, SCHEDULER_OP_WRITE, false, 3 * SECOND);
+	check(scheduler_submit(s, SCHEDULER_OP_WRITE, false, NULL) == 0,
+	      "first job not at the faster station");
+	check(scheduler_submit(s, SCHEDULER_OP_WRITE, false, NULL) == 0,
+	      "second job not at the faster station");
+	check(scheduler_submit(s, SCHEDULER_OP_WRITE, false, NULL) == 0,
+	      "tied job not at the lower station");
+	check(scheduler_submit(s, SCHEDULER_OP_WRITE, false, NULL) == 1,
+	      "fourth job not at the slower station");
+	check(scheduler_expected(s, 0) == 3 * SECOND &&
+	      scheduler_expected(s, 1) == 3 * SECOND,
+	      "expected completion times wrong");
+
+	/*
+	 * The average moves an eighth of the way to each new sample, so after
+	 * enough of them station 0 is known to take two and a half seconds.
+	 */
+	for (i = 0; i < 100; i++)
+		scheduler_record(s, 0, SCHEDULER_OP_WRITE, false,
+				 5 * SECOND / 2);
+	check(scheduler_expected(s, 0) > 3 * (5 * SECOND / 2 - SECOND / 100) &&
+	      scheduler_expected(s, 0) <= 3 * 5 * SECOND / 2,
+	      "average did not converge");
+
+	/*
+	 * Now station 1 is the better bet for the last of station 0's queue,
+	 * and rebalancing should move it there, but no more.
+	 */
+	scheduler_rebalance(s);
+	check(scheduler_queued(s, 0) == 2 && scheduler_queued(s, 1) == 2,
+	      "rebalance did not even out the queues");
+
+	/*
+	 * Drain station 1, then have it take work from station 0.
+	 */
+	while (scheduler_queued(s, 1) != 0) {
+		check(scheduler_next(s, 1, &op, &hico, &arg),
+		      "station 1 had nothing to do");
+		scheduler_done(s, 1);
+	}
+	check(scheduler_next(s, 1, &op, &hico, &arg),
+	      "idle station did not take work");
+	check(op == SCHEDULER_OP_WRITE && !hico,
+	      "job not handed out as submitted");
+	check(scheduler_queued(s, 0) == 1, "work not taken from station 0");
+
+	/*
+	 * High coercivity writes are learned separately from low.
+	 */
+	scheduler_record(s, 0, SCHEDULER_OP_WRITE, true, 1 * SECOND);
+	scheduler_record(s, 1, SCHEDULER_OP_WRITE, true, 10 * SECOND);
+	check(scheduler_submit(s, SCHEDULER_OP_WRITE, true, NULL) == 0,
+	      "high coercivity write not at the station fast at it");
+
+	scheduler_free(s);
+	return (0);
+}
+
+/*
+ * A bad operation is a programming error, and aborts.
+ */
+static void
+aborts(struct scheduler *s, bool submit, int op)
+{
+	struct rlimit rl;
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		/*
+		 * No core dumps from the crash we asked for.
+		 */
+		rl.rlim_cur = rl.rlim_max = 0;
+		(void)setrlimit(RLIMIT_CORE, &rl);
+		if (submit)
+			(void)scheduler_submit(s, op, false, NULL);
+		else
+			scheduler_record(s, 0, op, false, SECOND);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT)
+		errx(1, "%s with op %d did not abort",
+		     submit ? "scheduler_submit" : "scheduler_record", op);
+}
+
+static void
+check(bool ok, const char *what)
+{
+	if (!ok)
+		errx(1, "%s", what);
+}
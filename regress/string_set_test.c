@@ -0,0 +1,112 @@
+#include <sys/types.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_set.h"
+
+/*
+ * Add enough strings to grow the arena, the offsets and the table several
+ * times over, and check that every one is still there, in order, and still
+ * recognized as a duplicate.
+ */
+
+#define	ITEMS	(5000)
+
+struct visit {
+	size_t v_next;
+	bool v_ok;
+};
+
+static void check(bool, const char *);
+static void name(char *, size_t, size_t);
+static void visit(void *, const char *);
+
+int
+main(void)
+{
+	struct string_set *ss;
+	struct visit v;
+	char buf[64];
+	size_t i;
+
+	ss = string_set_create();
+	if (ss == NULL)
+		err(1, "string_set_create");
+
+	check(string_set_count(ss) == 0, "new set not empty");
+	check(string_set_get(ss, 0) == NULL, "got a string from an empty set");
+
+	for (i = 0; i < ITEMS; i++) {
+		name(buf, sizeof buf, i);
+		if (!string_set_add(ss, buf))
+			errx(1, "%s: rejected as a duplicate", buf);
+		if (string_set_add(ss, buf))
+			errx(1, "%s: added twice", buf);
+	}
+	check(string_set_add(ss, ""), "empty string rejected");
+	check(!string_set_add(ss, ""), "empty string added twice");
+	check(string_set_count(ss) == ITEMS + 1, "wrong count");
+
+	/*
+	 * Duplicates are found after growth as well as before it.
+	 */
+	for (i = 0; i < ITEMS; i++) {
+		name(buf, sizeof buf, i);
+		if (string_set_add(ss, buf))
+			errx(1, "%s: added again after growing", buf);
+		if (strcmp(string_set_get(ss, i), buf) != 0)
+			errx(1, "string %zu is %s, not %s", i,
+			     string_set_get(ss, i), buf);
+	}
+	check(strcmp(string_set_get(ss, ITEMS), "") == 0,
+	      "empty string not kept");
+	check(string_set_get(ss, ITEMS + 1) == NULL,
+	      "got a string past the end");
+	check(string_set_count(ss) == ITEMS + 1, "duplicates changed the count");
+
+	v.v_next = 0;
+	v.v_ok = true;
+	string_set_foreach(ss, visit, &v);
+	check(v.v_ok && v.v_next == ITEMS + 1,
+	      "foreach did not visit every string in order");
+
+	string_set_free(ss);
+	return (0);
+}
+
+static void
+check(bool ok, const char *what)
+{
+	if (!ok)
+		errx(1, "%s", what);
+}
+
+/*
+ * Names of varying length, so the arena does not grow in lock step with the
+ * offsets.
+ */
+static void
+name(char *buf, size_t len, size_t i)
+{
+	snprintf(buf, len, "/dev/cu.usbserial-%zu%.*s", i, (int)(i % 17),
+		 "ABCDEFGHIJKLMNOPQ");
+}
+
+static void
+visit(void *arg, const char *string)
+{
+	struct visit *v;
+	char buf[64];
+
+	v = arg;
+	if (v->v_next == ITEMS)
+		buf[0] = '\0';
+	else
+		name(buf, sizeof buf, v->v_next);
+	if (strcmp(string, buf) != 0)
+		v->v_ok = false;
+	v->v_next++;
+}
@@ -0,0 +1,483 @@
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scheduler.h"
+
+/*
+ * Hand out card jobs to a set of stations, each a reader with someone
+ * swiping cards through it, so that the whole queue finishes as early as
+ * possible.  How long a station takes per card depends on the device, the
+ * coercivity mode and mostly on whoever is at it, so we learn that as we go:
+ * every completed job updates a moving average of its cycle time, kept per
+ * operation and mode, both for the station as a whole and for the operator
+ * currently at it.
+ *
+ * A new job goes to the station which would finish it soonest, given what
+ * it is doing now and what it already has queued.  A station which runs dry
+ * takes work from whichever station is furthest behind, and
+ * scheduler_rebalance moves jobs from the back of long queues to stations
+ * which would get to them sooner.
+ *
+ * All times are in microseconds.
+ */
+
+#define	SCHEDULER_MODES			(2)
+#define	SCHEDULER_PROFILES		(8)
+#define	SCHEDULER_EWMA_SHIFT		(3)
+#define	SCHEDULER_DEFAULT_ESTIMATE	(5000000)
+
+struct scheduler_average {
+	uint64_t sa_value;
+	uint64_t sa_samples;
+};
+
+struct scheduler_profile {
+	unsigned sp_operator;
+	uint64_t sp_used;
+	struct scheduler_average sp_averages[SCHEDULER_OPS][SCHEDULER_MODES];
+};
+
+struct scheduler_job {
+	int sj_op;
+	bool sj_hico;
+	void *sj_arg;
+	TAILQ_ENTRY(scheduler_job) sj_link;
+};
+
+struct scheduler_station {
+	TAILQ_HEAD(scheduler_job_queue, scheduler_job) ss_queue;
+	size_t ss_queued;
+	struct scheduler_job *ss_current;
+	uint64_t ss_started;
+	unsigned ss_operator;
+	struct scheduler_average ss_averages[SCHEDULER_OPS][SCHEDULER_MODES];
+	struct scheduler_profile ss_profiles[SCHEDULER_PROFILES];
+	uint64_t ss_profile_clock;
+};
+
+struct scheduler {
+	pthread_mutex_t s_lock;
+	struct scheduler_average s_averages[SCHEDULER_OPS][SCHEDULER_MODES];
+	size_t s_nstations;
+	struct scheduler_station s_stations[];
+};
+
+static void scheduler_average_update(struct scheduler_average *, uint64_t);
+static uint64_t scheduler_estimate(struct scheduler *, size_t, int, bool);
+static uint64_t scheduler_expected_locked(struct scheduler *, size_t);
+static uint64_t scheduler_now(void);
+static struct scheduler_profile *scheduler_profile(struct scheduler_station *, bool);
+static void scheduler_rebalance_locked(struct scheduler *);
+static void scheduler_record_locked(struct scheduler *, size_t, int, bool, uint64_t);
+static void scheduler_steal(struct scheduler *, size_t);
+
+struct scheduler *
+scheduler_create(size_t nstations)
+{
+	struct scheduler *s;
+	size_t i;
+
+	/*
+	 * Jobs have to go somewhere.
+	 */
+	if (nstations == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	s = calloc(1, sizeof *s + nstations * sizeof s->s_stations[0]);
+	if (s == NULL)
+		return (NULL);
+
+	if (pthread_mutex_init(&s->s_lock, NULL) != 0) {
+		free(s);
+		return (NULL);
+	}
+
+	s->s_nstations = nstations;
+	for (i = 0; i < nstations; i++)
+		TAILQ_INIT(&s->s_stations[i].ss_queue);
+	return (s);
+}
+
+void
+scheduler_free(struct scheduler *s)
+{
+	struct scheduler_station *ss;
+	struct scheduler_job *sj;
+	size_t i;
+
+	for (i = 0; i < s->s_nstations; i++) {
+		ss = &s->s_stations[i];
+		while ((sj = TAILQ_FIRST(&ss->ss_queue)) != NULL) {
+			TAILQ_REMOVE(&ss->ss_queue, sj, sj_link);
+			free(sj);
+		}
+		free(ss->ss_current);
+	}
+	pthread_mutex_destroy(&s->s_lock);
+	free(s);
+}
+
+void
+scheduler_set_operator(struct scheduler *s, size_t station, unsigned operator)
+{
+	pthread_mutex_lock(&s->s_lock);
+	s->s_stations[station].ss_operator = operator;
+	pthread_mutex_unlock(&s->s_lock);
+}
+
+size_t
+scheduler_submit(struct scheduler *s, int op, bool hico, void *arg)
+{
+	struct scheduler_job *sj;
+	uint64_t best, expected;
+	size_t i, station;
+
+	if (op < 0 || op >= SCHEDULER_OPS)
+		abort();
+
+	sj = malloc(sizeof *sj);
+	if (sj == NULL)
+		abort();
+	sj->sj_op = op;
+	sj->sj_hico = hico;
+	sj->sj_arg = arg;
+
+	pthread_mutex_lock(&s->s_lock);
+	station = 0;
+	best = UINT64_MAX;
+	for (i = 0; i < s->s_nstations; i++) {
+		expected = scheduler_expected_locked(s, i) +
+		    scheduler_estimate(s, i, op, hico);
+		if (expected < best) {
+			best = expected;
+			station = i;
+		}
+	}
+	TAILQ_INSERT_TAIL(&s->s_stations[station].ss_queue, sj, sj_link);
+	s->s_stations[station].ss_queued++;
+	pthread_mutex_unlock(&s->s_lock);
+
+	return (station);
+}
+
+bool
+scheduler_next(struct scheduler *s, size_t station, int *op, bool *hico, void **arg)
+{
+	struct scheduler_station *ss;
+	struct scheduler_job *sj;
+
+	pthread_mutex_lock(&s->s_lock);
+	ss = &s->s_stations[station];
+
+	/*
+	 * Whatever was running before is done, whether or not anyone told us.
+	 */
+	free(ss->ss_current);
+	ss->ss_current = NULL;
+
+	/*
+	 * If we have nothing to do, see whether someone else has work we
+	 * would get to sooner than they would.
+	 */
+	if (TAILQ_EMPTY(&ss->ss_queue))
+		scheduler_steal(s, station);
+
+	sj = TAILQ_FIRST(&ss->ss_queue);
+	if (sj == NULL) {
+		pthread_mutex_unlock(&s->s_lock);
+		return (false);
+	}
+	TAILQ_REMOVE(&ss->ss_queue, sj, sj_link);
+	ss->ss_queued--;
+
+	ss->ss_current = sj;
+	ss->ss_started = scheduler_now();
+
+	/*
+	 * Once we let go, the job belongs to whoever next calls
+	 * scheduler_next or scheduler_done for this station.
+	 */
+	*op = sj->sj_op;
+	*hico = sj->sj_hico;
+	*arg = sj->sj_arg;
+	pthread_mutex_unlock(&s->s_lock);
+	return (true);
+}
+
+void
+scheduler_done(struct scheduler *s, size_t station)
+{
+	struct scheduler_station *ss;
+	struct scheduler_job *sj;
+
+	pthread_mutex_lock(&s->s_lock);
+	ss = &s->s_stations[station];
+	sj = ss->ss_current;
+	if (sj != NULL) {
+		scheduler_record_locked(s, station, sj->sj_op, sj->sj_hico,
+					scheduler_now() - ss->ss_started);
+		ss->ss_current = NULL;
+		free(sj);
+	}
+	pthread_mutex_unlock(&s->s_lock);
+}
+
+void
+scheduler_rebalance(struct scheduler *s)
+{
+	pthread_mutex_lock(&s->s_lock);
+	scheduler_rebalance_locked(s);
+	pthread_mutex_unlock(&s->s_lock);
+}
+
+void
+scheduler_record(struct scheduler *s, size_t station, int op, bool hico, uint64_t usec)
+{
+	if (op < 0 || op >= SCHEDULER_OPS)
+		abort();
+
+	pthread_mutex_lock(&s->s_lock);
+	scheduler_record_locked(s, station, op, hico, usec);
+	pthread_mutex_unlock(&s->s_lock);
+}
+
+uint64_t
+scheduler_expected(struct scheduler *s, size_t station)
+{
+	uint64_t expected;
+
+	pthread_mutex_lock(&s->s_lock);
+	expected = scheduler_expected_locked(s, station);
+	pthread_mutex_unlock(&s->s_lock);
+	return (expected);
+}
+
+size_t
+scheduler_queued(struct scheduler *s, size_t station)
+{
+	size_t queued;
+
+	pthread_mutex_lock(&s->s_lock);
+	queued = s->s_stations[station].ss_queued;
+	pthread_mutex_unlock(&s->s_lock);
+	return (queued);
+}
+
+static void
+scheduler_average_update(struct scheduler_average *sa, uint64_t sample)
+{
+	if (sa->sa_samples++ == 0) {
+		sa->sa_value = sample;
+		return;
+	}
+	if (sample > sa->sa_value)
+		sa->sa_value += (sample - sa->sa_value) >> SCHEDULER_EWMA_SHIFT;
+	else
+		sa->sa_value -= (sa->sa_value - sample) >> SCHEDULER_EWMA_SHIFT;
+}
+
+static uint64_t
+scheduler_estimate(struct scheduler *s, size_t station, int op, bool hico)
+{
+	struct scheduler_station *ss;
+	struct scheduler_profile *sp;
+	struct scheduler_average *sa;
+
+	ss = &s->s_stations[station];
+
+	/*
+	 * Use the most specific thing we know: this operator at this
+	 * station, then anyone at this station, then anyone anywhere.
+	 */
+	sp = scheduler_profile(ss, false);
+	if (sp != NULL) {
+		sa = &sp->sp_averages[op][hico];
+		if (sa->sa_samples != 0)
+			return (sa->sa_value);
+	}
+
+	sa = &ss->ss_averages[op][hico];
+	if (sa->sa_samples != 0)
+		return (sa->sa_value);
+
+	sa = &s->s_averages[op][hico];
+	if (sa->sa_samples != 0)
+		return (sa->sa_value);
+
+	return (SCHEDULER_DEFAULT_ESTIMATE);
+}
+
+static uint64_t
+scheduler_expected_locked(struct scheduler *s, size_t station)
+{
+	struct scheduler_station *ss;
+	struct scheduler_job *sj;
+	uint64_t elapsed, estimate, expected;
+
+	ss = &s->s_stations[station];
+	expected = 0;
+
+	/*
+	 * Whatever is left of the current job, guessing that it is nearly done
+	 * if it has already run over.
+	 */
+	if (ss->ss_current != NULL) {
+		estimate = scheduler_estimate(s, station,
+					      ss->ss_current->sj_op,
+					      ss->ss_current->sj_hico);
+		elapsed = scheduler_now() - ss->ss_started;
+		if (elapsed < estimate)
+			expected += estimate - elapsed;
+	}
+
+	TAILQ_FOREACH(sj, &ss->ss_queue, sj_link)
+		expected += scheduler_estimate(s, station, sj->sj_op,
+					       sj->sj_hico);
+	return (expected);
+}
+
+static uint64_t
+scheduler_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static struct scheduler_profile *
+scheduler_profile(struct scheduler_station *ss, bool create)
+{
+	struct scheduler_profile *sp, *oldest;
+	unsigned i;
+
+	oldest = NULL;
+	for (i = 0; i < SCHEDULER_PROFILES; i++) {
+		sp = &ss->ss_profiles[i];
+		if (sp->sp_used != 0 && sp->sp_operator == ss->ss_operator) {
+			if (create)
+				sp->sp_used = ++ss->ss_profile_clock;
+			return (sp);
+		}
+		if (oldest == NULL || sp->sp_used < oldest->sp_used)
+			oldest = sp;
+	}
+	if (!create)
+		return (NULL);
+
+	/*
+	 * Forget whoever has not been at this station for longest.
+	 */
+	memset(oldest, 0, sizeof *oldest);
+	oldest->sp_operator = ss->ss_operator;
+	oldest->sp_used = ++ss->ss_profile_clock;
+	return (oldest);
+}
+
+static void
+scheduler_rebalance_locked(struct scheduler *s)
+{
+	struct scheduler_station *from;
+	struct scheduler_job *sj;
+	uint64_t latest, soonest, expected, estimate;
+	size_t i, busiest, idlest;
+	size_t moves;
+
+	if (s->s_nstations < 2)
+		return;
+
+	/*
+	 * Move the last job of whichever station will finish last to
+	 * whichever will finish first, for as long as that gets it done
+	 * sooner.  Each move strictly lowers the later finish time of the
+	 * pair, but bound it anyway in case the estimates shift under us.
+	 */
+	for (moves = 0; moves < 1024; moves++) {
+		busiest = idlest = 0;
+		latest = 0;
+		soonest = UINT64_MAX;
+		for (i = 0; i < s->s_nstations; i++) {
+			expected = scheduler_expected_locked(s, i);
+			if (!TAILQ_EMPTY(&s->s_stations[i].ss_queue) &&
+			    expected >= latest) {
+				latest = expected;
+				busiest = i;
+			}
+			if (expected < soonest) {
+				soonest = expected;
+				idlest = i;
+			}
+		}
+		if (latest == 0 || busiest == idlest)
+			return;
+
+		from = &s->s_stations[busiest];
+		sj = TAILQ_LAST(&from->ss_queue, scheduler_job_queue);
+		estimate = scheduler_estimate(s, idlest, sj->sj_op, sj->sj_hico);
+		if (soonest + estimate >= latest)
+			return;
+
+		TAILQ_REMOVE(&from->ss_queue, sj, sj_link);
+		from->ss_queued--;
+		TAILQ_INSERT_TAIL(&s->s_stations[idlest].ss_queue, sj, sj_link);
+		s->s_stations[idlest].ss_queued++;
+	}
+}
+
+static void
+scheduler_record_locked(struct scheduler *s, size_t station, int op, bool hico, uint64_t usec)
+{
+	struct scheduler_station *ss;
+
+	ss = &s->s_stations[station];
+	scheduler_average_update(&scheduler_profile(ss, true)->sp_averages[op][hico],
+				 usec);
+	scheduler_average_update(&ss->ss_averages[op][hico], usec);
+	scheduler_average_update(&s->s_averages[op][hico], usec);
+}
+
+static void
+scheduler_steal(struct scheduler *s, size_t station)
+{
+	struct scheduler_station *from;
+	struct scheduler_job *sj;
+	uint64_t latest, expected;
+	size_t i, busiest;
+
+	busiest = station;
+	latest = 0;
+	for (i = 0; i < s->s_nstations; i++) {
+		if (i == station || TAILQ_EMPTY(&s->s_stations[i].ss_queue))
+			continue;
+		expected = scheduler_expected_locked(s, i);
+		if (expected > latest) {
+			latest = expected;
+			busiest = i;
+		}
+	}
+	if (busiest == station)
+		return;
+
+	/*
+	 * Take their last job, provided that we would finish it before they
+	 * would finish everything.
+	 */
+	from = &s->s_stations[busiest];
+	sj = TAILQ_LAST(&from->ss_queue, scheduler_job_queue);
+	if (scheduler_estimate(s, station, sj->sj_op, sj->sj_hico) >= latest)
+		return;
+
+	TAILQ_REMOVE(&from->ss_queue, sj, sj_link);
+	from->ss_queued--;
+	TAILQ_INSERT_TAIL(&s->s_stations[station].ss_queue, sj, sj_link);
+	s->s_stations[station].ss_queued++;
+}
@@ -0,0 +1,25 @@
+#ifndef	SCHEDULER_H
+#define	SCHEDULER_H
+
+struct scheduler;
+
+#define	SCHEDULER_OP_READ	(0)
+#define	SCHEDULER_OP_WRITE	(1)
+#define	SCHEDULER_OP_ERASE	(2)
+#define	SCHEDULER_OPS		(3)
+
+struct scheduler *scheduler_create(size_t);
+void scheduler_free(struct scheduler *);
+
+void scheduler_set_operator(struct scheduler *, size_t, unsigned);
+
+size_t scheduler_submit(struct scheduler *, int, bool, void *);
+bool scheduler_next(struct scheduler *, size_t, int *, bool *, void **);
+void scheduler_done(struct scheduler *, size_t);
+void scheduler_rebalance(struct scheduler *);
+
+void scheduler_record(struct scheduler *, size_t, int, bool, uint64_t);
+uint64_t scheduler_expected(struct scheduler *, size_t);
+size_t scheduler_queued(struct scheduler *, size_t);
+
+#endif /* !SCHEDULER_H */
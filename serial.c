@@ -4,77 +4,296 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "serial.h"
+#include "serial_replay.h"
 #include "string_set.h"
 
 #define	SERIAL_DEVICE_DIRECTORY	"/dev"
+#ifdef	__linux__
+#define	SERIAL_DEVICE_REGEX	"^(tty(USB|ACM)[0-9]+)$"
+#define	SERIAL_DEVICE_FORMAT	SERIAL_DEVICE_DIRECTORY "/%s"
+#else
 #define	SERIAL_DEVICE_REGEX	"^cu\\.(.+)$"
 #define	SERIAL_DEVICE_FORMAT	SERIAL_DEVICE_DIRECTORY "/cu.%s"
+#endif
+
+/*
+ * Line speeds we know how to ask termios for.
+ */
+static const struct serial_port_speed {
+	unsigned sps_rate;
+	speed_t sps_speed;
+} serial_port_speeds[] = {
+	{ 1200,		B1200 },
+	{ 2400,		B2400 },
+	{ 4800,		B4800 },
+	{ 9600,		B9600 },
+	{ 19200,	B19200 },
+	{ 38400,	B38400 },
+	{ 57600,	B57600 },
+	{ 115200,	B115200 },
+};
+
+static void serial_port_clear(struct serial_port *);
+static bool serial_port_fail(struct serial_port *, int);
+static void serial_port_init(struct serial_port *);
+static void serial_port_release(struct serial_port *);
+
+void
+serial_port_config_default(struct serial_port_config *config)
+{
+	/*
+	 * What the EZ Writer comes up talking: 9600 8N1 with XON/XOFF.
+	 */
+	config->spc_speed = 9600;
+	config->spc_databits = 8;
+	config->spc_parity = 'N';
+	config->spc_stopbits = 1;
+	config->spc_xonxoff = true;
+}
 
 bool
 serial_port_open(struct serial_port *sport, const char *name)
 {
-	struct termios control;
+	struct serial_port_config config;
+
+	serial_port_config_default(&config);
+	return (serial_port_open_config(sport, name, &config));
+}
+
+bool
+serial_port_open_config(struct serial_port *sport, const char *name, const struct serial_port_config *config)
+{
 	char path[MAXPATHLEN];
 	int error;
 	int fd;
 
-	sport->sp_fd = -1;
+	/*
+	 * The lock comes first, so that a port which failed to open is still
+	 * safe to lock, and anything done with it fails cleanly with EBADF.
+	 */
+	serial_port_init(sport);
 
-	snprintf(path, sizeof path, SERIAL_DEVICE_FORMAT, name);
+	if (!serial_port_path(name, path, sizeof path)) {
+		errno = ENAMETOOLONG;
+		return (false);
+	}
 	fd = open(path, O_RDWR | /*O_NONBLOCK | */O_NOCTTY);
 	if (fd == -1)
 		return (false);
 	sport->sp_fd = fd;
 
-	error = ioctl(sport->sp_fd, TIOCEXCL);
-	if (error != 0) {
-		close(sport->sp_fd);
-		sport->sp_fd = -1;
+	if (ioctl(sport->sp_fd, TIOCEXCL) != 0 ||
+	    !serial_port_configure(sport, config)) {
+		error = errno;
+		serial_port_release(sport);
+		errno = error;
 		return (false);
 	}
 
-	error = tcgetattr(sport->sp_fd, &control);
-	if (error != 0) {
-		close(sport->sp_fd);
-		sport->sp_fd = -1;
+	return (true);
+}
+
+bool
+serial_port_open_replay(struct serial_port *sport, const struct serial_transcript *st, bool compress)
+{
+	serial_port_init(sport);
+
+	sport->sp_replay = serial_replay_create(st, compress);
+	return (sport->sp_replay != NULL);
+}
+
+/*
+ * The device a port name refers to, as serial_port_open will open it.  A full
+ * path, e.g. one from serial_discovery, is taken as-is.
+ */
+bool
+serial_port_path(const char *name, char *path, size_t len)
+{
+	int rv;
+
+	if (name[0] == '/')
+		rv = snprintf(path, len, "%s", name);
+	else
+		rv = snprintf(path, len, SERIAL_DEVICE_FORMAT, name);
+	return (rv >= 0 && (size_t)rv < len);
+}
+
+void
+serial_port_close(struct serial_port *sport)
+{
+	/*
+	 * Wait for anyone part way through a call to finish with the port.
+	 * Nobody may start another once we are here, since the lock goes
+	 * away with the port.
+	 */
+	serial_port_lock(sport);
+	serial_port_release(sport);
+	serial_port_unlock(sport);
+	if (pthread_mutex_destroy(&sport->sp_lock) != 0)
+		abort();
+}
+
+void
+serial_port_delay(struct serial_port *sport, unsigned long usec)
+{
+	if (sport->sp_replay != NULL) {
+		serial_replay_delay(sport->sp_replay, usec);
+		return;
+	}
+	usleep(usec);
+}
+
+bool
+serial_port_record(struct serial_port *sport, const char *path)
+{
+	if (sport->sp_recorder != NULL)
+		serial_recorder_free(sport->sp_recorder);
+
+	sport->sp_recorder = serial_recorder_create(path);
+	return (sport->sp_recorder != NULL);
+}
+
+void
+serial_port_lock(struct serial_port *sport)
+{
+	if (pthread_mutex_lock(&sport->sp_lock) != 0)
+		abort();
+}
+
+void
+serial_port_unlock(struct serial_port *sport)
+{
+	if (pthread_mutex_unlock(&sport->sp_lock) != 0)
+		abort();
+}
+
+bool
+serial_port_configure(struct serial_port *sport, const struct serial_port_config *config)
+{
+	struct termios control;
+	unsigned i;
+	int error;
+
+	if (sport->sp_fd == -1 && sport->sp_replay == NULL)
+		return (false);
+
+	for (i = 0; i < sizeof serial_port_speeds / sizeof serial_port_speeds[0]; i++) {
+		if (serial_port_speeds[i].sps_rate == config->spc_speed)
+			break;
+	}
+	if (i == sizeof serial_port_speeds / sizeof serial_port_speeds[0])
 		return (false);
+
+	/*
+	 * A replayed device talks at whatever speed we like.
+	 */
+	if (sport->sp_replay != NULL) {
+		sport->sp_config = *config;
+		return (true);
 	}
 
+	error = tcgetattr(sport->sp_fd, &control);
+	if (error != 0)
+		return (false);
+
 	cfmakeraw(&control);
 
-	error = cfsetspeed(&control, B9600);
-	if (error != 0) {
-		close(sport->sp_fd);
-		sport->sp_fd = -1;
+	error = cfsetspeed(&control, serial_port_speeds[i].sps_speed);
+	if (error != 0)
 		return (false);
-	}
 
-	control.c_cflag &= ~PARENB;
-	control.c_cflag &= ~CSTOPB;
 	control.c_cflag &= ~CSIZE;
-	control.c_cflag |= CS8;
+	switch (config->spc_databits) {
+	case 5:
+		control.c_cflag |= CS5;
+		break;
+	case 6:
+		control.c_cflag |= CS6;
+		break;
+	case 7:
+		control.c_cflag |= CS7;
+		break;
+	case 8:
+		control.c_cflag |= CS8;
+		break;
+	default:
+		return (false);
+	}
+
+	switch (config->spc_parity) {
+	case 'N':
+		control.c_cflag &= ~PARENB;
+		break;
+	case 'E':
+		control.c_cflag |= PARENB;
+		control.c_cflag &= ~PARODD;
+		break;
+	case 'O':
+		control.c_cflag |= PARENB | PARODD;
+		break;
+	default:
+		return (false);
+	}
+
+	switch (config->spc_stopbits) {
+	case 1:
+		control.c_cflag &= ~CSTOPB;
+		break;
+	case 2:
+		control.c_cflag |= CSTOPB;
+		break;
+	default:
+		return (false);
+	}
+
 	control.c_cflag |= CLOCAL;
 
-	control.c_iflag |= IXON | IXOFF;
+	if (config->spc_xonxoff)
+		control.c_iflag |= IXON | IXOFF;
+	else
+		control.c_iflag &= ~(IXON | IXOFF);
 
 	control.c_cc[VMIN] = 1;
 	control.c_cc[VTIME] = 0;
 
 	error = tcsetattr(sport->sp_fd, TCSAFLUSH, &control);
-	if (error != 0) {
-		close(sport->sp_fd);
-		sport->sp_fd = -1;
+	if (error != 0)
 		return (false);
+
+	sport->sp_config = *config;
+	return (true);
+}
+
+bool
+serial_port_flush(struct serial_port *sport)
+{
+	if (sport->sp_replay != NULL) {
+		sport->sp_error.spe_sync = true;
+		return (true);
 	}
 
+	if (sport->sp_fd == -1)
+		return (false);
+
+	/*
+	 * Throw away anything either side still has queued, which puts us
+	 * back at a command boundary if the device is idle.
+	 */
+	if (tcflush(sport->sp_fd, TCIOFLUSH) != 0)
+		return (serial_port_fail(sport, errno));
+	sport->sp_error.spe_sync = true;
 	return (true);
 }
 
@@ -82,31 +301,118 @@ bool
 serial_port_read(struct serial_port *sport, char *buf, size_t len)
 {
 	ssize_t rv;
+	int error;
+
+	if (sport->sp_replay != NULL) {
+		error = serial_replay_read(sport->sp_replay, buf, len);
+		if (error != 0)
+			return (serial_port_fail(sport, error));
+		return (true);
+	}
 
 	if (sport->sp_fd == -1)
-		return (false);
+		return (serial_port_fail(sport, EBADF));
 
 	rv = read(sport->sp_fd, buf, len);
 	if (rv == -1)
-		return (false);
+		return (serial_port_fail(sport, errno));
+	if (rv == 0)
+		return (serial_port_fail(sport, EIO));
+	if (sport->sp_recorder != NULL)
+		serial_recorder_received(sport->sp_recorder, buf, rv);
 	if (len != (size_t)rv)
 		return (serial_port_read(sport, buf + rv, len - rv));
 	return (true);
 }
 
+bool
+serial_port_read_timeout(struct serial_port *sport, char *buf, size_t len, unsigned msec)
+{
+	struct timespec now, deadline;
+	struct pollfd pfd;
+	long remaining;
+	ssize_t rv;
+	int error;
+
+	/*
+	 * The transcript knows whether the device answered in time.
+	 */
+	if (sport->sp_replay != NULL) {
+		error = serial_replay_read(sport->sp_replay, buf, len);
+		if (error != 0)
+			return (serial_port_fail(sport, error));
+		return (true);
+	}
+
+	if (sport->sp_fd == -1)
+		return (serial_port_fail(sport, EBADF));
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += msec / 1000;
+	deadline.tv_nsec += (msec % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while (len != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+		    (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+		if (remaining < 0)
+			remaining = 0;
+
+		pfd.fd = sport->sp_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		error = poll(&pfd, 1, remaining);
+		if (error == -1) {
+			if (errno == EINTR)
+				continue;
+			return (serial_port_fail(sport, errno));
+		}
+		if (error == 0)
+			return (serial_port_fail(sport, ETIMEDOUT));
+
+		rv = read(sport->sp_fd, buf, len);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			return (serial_port_fail(sport, errno));
+		}
+		if (rv == 0)
+			return (serial_port_fail(sport, EIO));
+		if (sport->sp_recorder != NULL)
+			serial_recorder_received(sport->sp_recorder, buf, rv);
+		buf += rv;
+		len -= rv;
+	}
+	return (true);
+}
+
 bool
 serial_port_write(struct serial_port *sport, const char *buf, size_t len)
 {
 	ssize_t rv;
+	int error;
+
+	if (sport->sp_replay != NULL) {
+		error = serial_replay_write(sport->sp_replay, buf, len);
+		if (error != 0)
+			return (serial_port_fail(sport, error));
+		return (true);
+	}
 
 	if (sport->sp_fd == -1)
-		return (false);
+		return (serial_port_fail(sport, EBADF));
 
 	rv = write(sport->sp_fd, buf, len);
 	if (rv == -1)
-		return (false);
+		return (serial_port_fail(sport, errno));
+	if (sport->sp_recorder != NULL && rv > 0)
+		serial_recorder_sent(sport->sp_recorder, buf, rv);
 	if (len != (size_t)rv)
-		return (false);
+		return (serial_port_fail(sport, EIO));
 	return (true);
 }
 
@@ -159,3 +465,63 @@ serial_port_enumerate(void)
 	closedir(dir);
 	return (ss);
 }
+
+static void
+serial_port_clear(struct serial_port *sport)
+{
+	memset(&sport->sp_error, 0, sizeof sport->sp_error);
+	sport->sp_error.spe_sync = true;
+	serial_port_config_default(&sport->sp_config);
+	sport->sp_replay = NULL;
+	sport->sp_recorder = NULL;
+}
+
+static bool
+serial_port_fail(struct serial_port *sport, int error)
+{
+	sport->sp_error.spe_fault = SERIAL_PORT_FAULT_IO;
+	sport->sp_error.spe_status = -1;
+	sport->sp_error.spe_errno = error;
+	sport->sp_error.spe_sync = false;
+	return (false);
+}
+
+static void
+serial_port_init(struct serial_port *sport)
+{
+	pthread_mutexattr_t attr;
+	int error;
+
+	sport->sp_fd = -1;
+	serial_port_clear(sport);
+
+	/*
+	 * The lock is recursive so that a caller can hold it around a
+	 * sequence of ez_writer calls, which take it themselves, and still
+	 * look at sp_error afterwards without anyone else getting in.
+	 */
+	if (pthread_mutexattr_init(&attr) != 0)
+		abort();
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	error = pthread_mutex_init(&sport->sp_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (error != 0)
+		abort();
+}
+
+static void
+serial_port_release(struct serial_port *sport)
+{
+	if (sport->sp_replay != NULL) {
+		serial_replay_free(sport->sp_replay);
+		sport->sp_replay = NULL;
+	}
+	if (sport->sp_recorder != NULL) {
+		serial_recorder_free(sport->sp_recorder);
+		sport->sp_recorder = NULL;
+	}
+	if (sport->sp_fd != -1) {
+		close(sport->sp_fd);
+		sport->sp_fd = -1;
+	}
+}
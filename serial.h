@@ -1,16 +1,80 @@
 #ifndef	SERIAL_H
 #define	SERIAL_H
 
+#include <pthread.h>
+
 struct serial_port;
+struct serial_recorder;
+struct serial_replay;
+struct serial_transcript;
 struct string_set;
 
+#define	SERIAL_PORT_FAULT_NONE		(0)
+#define	SERIAL_PORT_FAULT_ARGUMENT	(1)	/* Rejected before any I/O.  */
+#define	SERIAL_PORT_FAULT_IO		(2)	/* Read or write failed.  */
+#define	SERIAL_PORT_FAULT_FRAMING	(3)	/* Response did not parse.  */
+#define	SERIAL_PORT_FAULT_STATUS	(4)	/* Device reported failure.  */
+
+/*
+ * Why the last operation on a port failed.  The serial layer fills in I/O
+ * faults; the protocol layer sets the stage and anything it finds wrong with
+ * what came back.  If spe_sync is false, there may be unread response bytes
+ * or a partial command on the line.
+ */
+struct serial_port_error {
+	int spe_stage;
+	int spe_fault;
+	int spe_status;
+	int spe_errno;
+	bool spe_sync;
+};
+
+struct serial_port_config {
+	unsigned spc_speed;		/* Bits per second.  */
+	unsigned spc_databits;
+	char spc_parity;		/* 'N', 'E' or 'O'.  */
+	unsigned spc_stopbits;
+	bool spc_xonxoff;
+};
+
+/*
+ * The protocol layer holds sp_lock for the duration of each call, so that any
+ * number of threads may share a port.  The raw I/O routines here do not take
+ * it; callers going around the protocol layer on a shared port must.
+ *
+ * Once any of the open routines has been called, the port has a lock whether
+ * or not it opened, and must be given back with serial_port_close.  Closing
+ * waits for a call in progress to finish, but no thread may start another
+ * call on the port once it is being closed, nor use it afterwards until it
+ * is opened again.
+ */
 struct serial_port {
 	int sp_fd;
+	pthread_mutex_t sp_lock;
+	struct serial_port_config sp_config;
+	struct serial_port_error sp_error;
+	struct serial_replay *sp_replay;
+	struct serial_recorder *sp_recorder;
 };
 
+void serial_port_config_default(struct serial_port_config *);
+
 bool serial_port_open(struct serial_port *, const char *);
+bool serial_port_open_config(struct serial_port *, const char *,
+			     const struct serial_port_config *);
+bool serial_port_configure(struct serial_port *,
+			   const struct serial_port_config *);
+bool serial_port_open_replay(struct serial_port *,
+			     const struct serial_transcript *, bool);
+bool serial_port_path(const char *, char *, size_t);
 void serial_port_close(struct serial_port *);
+void serial_port_delay(struct serial_port *, unsigned long);
+bool serial_port_record(struct serial_port *, const char *);
+bool serial_port_flush(struct serial_port *);
+void serial_port_lock(struct serial_port *);
+void serial_port_unlock(struct serial_port *);
 bool serial_port_read(struct serial_port *, char *, size_t);
+bool serial_port_read_timeout(struct serial_port *, char *, size_t, unsigned);
 bool serial_port_write(struct serial_port *, const char *, size_t);
 struct string_set *serial_port_enumerate(void);
 
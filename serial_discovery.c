@@ -0,0 +1,419 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "serial_discovery.h"
+
+/*
+ * Keep a list of the serial devices attached to the system, along with the
+ * USB identity of each, so that a particular reader can be picked out without
+ * opening every port to ask it.  The list is built once, and then kept up to
+ * date by watching the device directory, so looking something up never costs
+ * a scan.
+ */
+
+#ifdef	__linux__
+#include <sys/inotify.h>
+#include <sys/param.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	SERIAL_DISCOVERY_DEVICE_DIRECTORY	"/dev"
+#define	SERIAL_DISCOVERY_SYSFS_FORMAT		"/sys/class/tty/%s/device"
+#define	SERIAL_DISCOVERY_WATCH_EVENTS					\
+	(IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO)
+
+/*
+ * USB serial adapters and CDC ACM devices.  Built-in UARTs are not going to
+ * have a reader on them.
+ */
+static const char *serial_discovery_prefixes[] = {
+	"ttyUSB",
+	"ttyACM",
+};
+
+struct serial_discovery {
+	int sd_inotify;
+	struct serial_device *sd_devices;
+	size_t sd_count;
+	size_t sd_capacity;
+};
+
+static void serial_discovery_add(struct serial_discovery *, const char *);
+static ssize_t serial_discovery_index(struct serial_discovery *, const char *);
+static void serial_discovery_identify(struct serial_device *);
+static bool serial_discovery_match(const char *);
+static bool serial_discovery_read_attribute(const char *, const char *, char *, size_t);
+static void serial_discovery_remove(struct serial_discovery *, const char *);
+static bool serial_discovery_scan(struct serial_discovery *);
+
+struct serial_discovery *
+serial_discovery_create(void)
+{
+	struct serial_discovery *sd;
+	int error;
+
+	sd = malloc(sizeof *sd);
+	if (sd == NULL)
+		return (NULL);
+
+	sd->sd_devices = NULL;
+	sd->sd_count = 0;
+	sd->sd_capacity = 0;
+
+	/*
+	 * Start watching before we scan, so that nothing which appears in
+	 * between is missed.
+	 */
+	sd->sd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (sd->sd_inotify == -1) {
+		free(sd);
+		return (NULL);
+	}
+
+	if (inotify_add_watch(sd->sd_inotify, SERIAL_DISCOVERY_DEVICE_DIRECTORY,
+			      SERIAL_DISCOVERY_WATCH_EVENTS) == -1) {
+		error = errno;
+		serial_discovery_free(sd);
+		errno = error;
+		return (NULL);
+	}
+
+	if (!serial_discovery_scan(sd)) {
+		error = errno;
+		serial_discovery_free(sd);
+		errno = error;
+		return (NULL);
+	}
+
+	return (sd);
+}
+
+void
+serial_discovery_free(struct serial_discovery *sd)
+{
+	if (sd->sd_inotify != -1)
+		close(sd->sd_inotify);
+	free(sd->sd_devices);
+	free(sd);
+}
+
+int
+serial_discovery_fd(struct serial_discovery *sd)
+{
+	return (sd->sd_inotify);
+}
+
+bool
+serial_discovery_update(struct serial_discovery *sd)
+{
+	char buf[4096]
+	    __attribute__((__aligned__(__alignof__(struct inotify_event))));
+	const struct inotify_event *ie;
+	ssize_t rv;
+	char *p;
+
+	for (;;) {
+		rv = read(sd->sd_inotify, buf, sizeof buf);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return (true);
+			return (false);
+		}
+
+		for (p = buf; p < buf + rv; p += sizeof *ie + ie->len) {
+			ie = (const struct inotify_event *)p;
+
+			/*
+			 * If the kernel dropped events, we have no idea what
+			 * changed, so start over.
+			 */
+			if ((ie->mask & IN_Q_OVERFLOW) != 0) {
+				if (!serial_discovery_scan(sd))
+					return (false);
+				continue;
+			}
+
+			if (ie->len == 0 || !serial_discovery_match(ie->name))
+				continue;
+
+			if ((ie->mask & (IN_DELETE | IN_MOVED_FROM)) != 0)
+				serial_discovery_remove(sd, ie->name);
+			else
+				serial_discovery_add(sd, ie->name);
+		}
+	}
+}
+
+size_t
+serial_discovery_count(struct serial_discovery *sd)
+{
+	return (sd->sd_count);
+}
+
+const struct serial_device *
+serial_discovery_device(struct serial_discovery *sd, size_t i)
+{
+	if (i >= sd->sd_count)
+		return (NULL);
+	return (&sd->sd_devices[i]);
+}
+
+const struct serial_device *
+serial_discovery_find(struct serial_discovery *sd, unsigned vendor, unsigned product, const char *serial)
+{
+	const struct serial_device *sdev;
+	size_t i;
+
+	for (i = 0; i < sd->sd_count; i++) {
+		sdev = &sd->sd_devices[i];
+		if (!sdev->sdev_usb)
+			continue;
+		if (sdev->sdev_vendor != vendor || sdev->sdev_product != product)
+			continue;
+		if (serial != NULL && strcmp(sdev->sdev_serial, serial) != 0)
+			continue;
+		return (sdev);
+	}
+	return (NULL);
+}
+
+static void
+serial_discovery_add(struct serial_discovery *sd, const char *name)
+{
+	struct serial_device *sdev;
+	ssize_t i;
+
+	/*
+	 * If we already know about this device, we are most likely seeing
+	 * its permissions being set up after it was created, and by now there
+	 * may be more of it in sysfs to identify it by.
+	 */
+	i = serial_discovery_index(sd, name);
+	if (i != -1) {
+		serial_discovery_identify(&sd->sd_devices[i]);
+		return;
+	}
+
+	if (strlen(name) >= sizeof sdev->sdev_name)
+		return;
+
+	if (sd->sd_count == sd->sd_capacity) {
+		sd->sd_capacity = sd->sd_capacity == 0 ? 8 : sd->sd_capacity * 2;
+		sd->sd_devices = realloc(sd->sd_devices,
+					 sd->sd_capacity * sizeof sd->sd_devices[0]);
+		if (sd->sd_devices == NULL)
+			abort();
+	}
+
+	/*
+	 * The path has room for the directory on top of the longest name, so
+	 * this cannot be cut short.
+	 */
+	sdev = &sd->sd_devices[sd->sd_count++];
+	strcpy(sdev->sdev_name, name);
+	snprintf(sdev->sdev_path, sizeof sdev->sdev_path,
+		 SERIAL_DISCOVERY_DEVICE_DIRECTORY "/%s", name);
+	serial_discovery_identify(sdev);
+}
+
+static ssize_t
+serial_discovery_index(struct serial_discovery *sd, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sd->sd_count; i++) {
+		if (strcmp(sd->sd_devices[i].sdev_name, name) == 0)
+			return (i);
+	}
+	return (-1);
+}
+
+static void
+serial_discovery_identify(struct serial_device *sdev)
+{
+	char link[MAXPATHLEN], path[MAXPATHLEN];
+	char value[SERIAL_DEVICE_SERIAL_LENGTH];
+	char *slash;
+
+	sdev->sdev_usb = false;
+	sdev->sdev_vendor = 0;
+	sdev->sdev_product = 0;
+	sdev->sdev_serial[0] = '\0';
+
+	snprintf(link, sizeof link, SERIAL_DISCOVERY_SYSFS_FORMAT,
+		 sdev->sdev_name);
+	if (realpath(link, path) == NULL)
+		return;
+
+	/*
+	 * The tty hangs off a USB interface, which hangs off the USB device
+	 * which has the identity we want.  Walk up until we find it.
+	 */
+	for (;;) {
+		if (serial_discovery_read_attribute(path, "idVendor", value,
+						    sizeof value)) {
+			sdev->sdev_vendor = strtoul(value, NULL, 16);
+			break;
+		}
+		slash = strrchr(path, '/');
+		if (slash == NULL || slash == path)
+			return;
+		*slash = '\0';
+	}
+
+	if (!serial_discovery_read_attribute(path, "idProduct", value,
+					     sizeof value))
+		return;
+	sdev->sdev_product = strtoul(value, NULL, 16);
+
+	/*
+	 * Not every adapter has a serial number.
+	 */
+	serial_discovery_read_attribute(path, "serial", sdev->sdev_serial,
+					sizeof sdev->sdev_serial);
+	sdev->sdev_usb = true;
+}
+
+static bool
+serial_discovery_match(const char *name)
+{
+	size_t i, len;
+
+	for (i = 0; i < sizeof serial_discovery_prefixes /
+			sizeof serial_discovery_prefixes[0]; i++) {
+		len = strlen(serial_discovery_prefixes[i]);
+		if (strncmp(name, serial_discovery_prefixes[i], len) == 0 &&
+		    name[len] != '\0')
+			return (true);
+	}
+	return (false);
+}
+
+static bool
+serial_discovery_read_attribute(const char *dir, const char *attribute, char *buf, size_t len)
+{
+	char path[MAXPATHLEN];
+	ssize_t rv;
+	int fd;
+
+	if ((size_t)snprintf(path, sizeof path, "%s/%s", dir, attribute) >=
+	    sizeof path)
+		return (false);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (false);
+	rv = read(fd, buf, len - 1);
+	close(fd);
+	if (rv <= 0)
+		return (false);
+
+	/*
+	 * Strip the trailing newline.
+	 */
+	while (rv > 0 && (buf[rv - 1] == '\n' || buf[rv - 1] == '\0'))
+		rv--;
+	buf[rv] = '\0';
+	return (true);
+}
+
+static void
+serial_discovery_remove(struct serial_discovery *sd, const char *name)
+{
+	ssize_t i;
+
+	i = serial_discovery_index(sd, name);
+	if (i == -1)
+		return;
+
+	/*
+	 * Keep the list in the order the devices appeared in, so that the
+	 * numbers people pick ports by do not shuffle around.
+	 */
+	memmove(&sd->sd_devices[i], &sd->sd_devices[i + 1],
+		(sd->sd_count - i - 1) * sizeof sd->sd_devices[0]);
+	sd->sd_count--;
+}
+
+static bool
+serial_discovery_scan(struct serial_discovery *sd)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(SERIAL_DISCOVERY_DEVICE_DIRECTORY);
+	if (dir == NULL)
+		return (false);
+
+	sd->sd_count = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (serial_discovery_match(de->d_name))
+			serial_discovery_add(sd, de->d_name);
+	}
+
+	closedir(dir);
+	return (true);
+}
+#else
+/*
+ * Only Linux has the sysfs and inotify support this depends on.
+ */
+struct serial_discovery *
+serial_discovery_create(void)
+{
+	errno = EOPNOTSUPP;
+	return (NULL);
+}
+
+void
+serial_discovery_free(struct serial_discovery *sd)
+{
+	(void)sd;
+}
+
+int
+serial_discovery_fd(struct serial_discovery *sd)
+{
+	(void)sd;
+	return (-1);
+}
+
+bool
+serial_discovery_update(struct serial_discovery *sd)
+{
+	(void)sd;
+	return (false);
+}
+
+size_t
+serial_discovery_count(struct serial_discovery *sd)
+{
+	(void)sd;
+	return (0);
+}
+
+const struct serial_device *
+serial_discovery_device(struct serial_discovery *sd, size_t i)
+{
+	(void)sd;
+	(void)i;
+	return (NULL);
+}
+
+const struct serial_device *
+serial_discovery_find(struct serial_discovery *sd, unsigned vendor, unsigned product, const char *serial)
+{
+	(void)sd;
+	(void)vendor;
+	(void)product;
+	(void)serial;
+	return (NULL);
+}
+#endif
@@ -0,0 +1,29 @@
+#ifndef	SERIAL_DISCOVERY_H
+#define	SERIAL_DISCOVERY_H
+
+struct serial_discovery;
+
+#define	SERIAL_DEVICE_NAME_LENGTH	(64)
+#define	SERIAL_DEVICE_PATH_LENGTH	(SERIAL_DEVICE_NAME_LENGTH + 5)	/* /dev/ */
+#define	SERIAL_DEVICE_SERIAL_LENGTH	(128)
+
+struct serial_device {
+	char sdev_name[SERIAL_DEVICE_NAME_LENGTH];
+	char sdev_path[SERIAL_DEVICE_PATH_LENGTH];
+	bool sdev_usb;
+	unsigned sdev_vendor;
+	unsigned sdev_product;
+	char sdev_serial[SERIAL_DEVICE_SERIAL_LENGTH];
+};
+
+struct serial_discovery *serial_discovery_create(void);
+void serial_discovery_free(struct serial_discovery *);
+
+int serial_discovery_fd(struct serial_discovery *);
+bool serial_discovery_update(struct serial_discovery *);
+
+size_t serial_discovery_count(struct serial_discovery *);
+const struct serial_device *serial_discovery_device(struct serial_discovery *, size_t);
+const struct serial_device *serial_discovery_find(struct serial_discovery *, unsigned, unsigned, const char *);
+
+#endif /* !SERIAL_DISCOVERY_H */
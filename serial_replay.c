@@ -0,0 +1,404 @@
+#include <sys/types.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serial_replay.h"
+
+/*
+ * Recorded sessions with a real device, and a fake device which plays them
+ * back, so that the protocol code can be run against odd timing, split reads
+ * and the like without a device, a card or anyone to swipe it.
+ *
+ * A transcript is a text file with one record per line:
+ *
+ *	> 1b 72			bytes we sent
+ *	< 1500 1b 73		bytes the device sent, 1500us after the last
+ *				record, as returned by a single read
+ *
+ * Blank lines and lines starting with '#' are ignored.
+ *
+ * On playback, everything we send is checked against the transcript, and
+ * reads are served the recorded bytes, after the recorded delay unless the
+ * replay is time-compressed.  Sends are compared as a byte stream, so it does
+ * not matter if they are split up differently from the recording.
+ */
+
+#define	SERIAL_TRANSCRIPT_SENT		('>')
+#define	SERIAL_TRANSCRIPT_RECEIVED	('<')
+
+struct serial_transcript_record {
+	char str_direction;
+	unsigned long str_delay;
+	size_t str_offset;
+	size_t str_len;
+};
+
+struct serial_transcript {
+	struct serial_transcript_record *st_records;
+	size_t st_count;
+	char *st_data;
+	size_t st_len;
+};
+
+struct serial_replay {
+	const struct serial_transcript *sr_transcript;
+	size_t sr_record;
+	size_t sr_offset;
+	bool sr_compress;
+	bool sr_failed;
+};
+
+struct serial_recorder {
+	FILE *srec_file;
+	struct timespec srec_last;
+};
+
+static unsigned long serial_recorder_elapsed(struct serial_recorder *);
+static void serial_recorder_log(struct serial_recorder *, const char *, const char *, size_t);
+static bool serial_transcript_parse(struct serial_transcript *, char *, size_t *, size_t *);
+static bool serial_transcript_whole(FILE *, const char *);
+
+struct serial_transcript *
+serial_transcript_load(const char *path)
+{
+	struct serial_transcript *st;
+	size_t records, data;
+	char line[4096];
+	FILE *file;
+	int error;
+
+	file = fopen(path, "r");
+	if (file == NULL)
+		return (NULL);
+
+	st = calloc(1, sizeof *st);
+	if (st == NULL) {
+		fclose(file);
+		return (NULL);
+	}
+
+	/*
+	 * Two passes: one to size the record array and the byte buffer, and
+	 * one to fill them in.
+	 */
+	records = data = 0;
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (!serial_transcript_whole(file, line) ||
+		    !serial_transcript_parse(NULL, line, &records, &data))
+			goto invalid;
+	}
+
+	st->st_records = calloc(records == 0 ? 1 : records,
+				sizeof st->st_records[0]);
+	st->st_data = malloc(data == 0 ? 1 : data);
+	if (st->st_records == NULL || st->st_data == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	rewind(file);
+	while (fgets(line, sizeof line, file) != NULL) {
+		if (!serial_transcript_parse(st, line, &st->st_count,
+					     &st->st_len))
+			goto invalid;
+	}
+	fclose(file);
+	return (st);
+
+invalid:
+	error = EINVAL;
+fail:
+	fclose(file);
+	serial_transcript_free(st);
+	errno = error;
+	return (NULL);
+}
+
+void
+serial_transcript_free(struct serial_transcript *st)
+{
+	free(st->st_records);
+	free(st->st_data);
+	free(st);
+}
+
+struct serial_replay *
+serial_replay_create(const struct serial_transcript *st, bool compress)
+{
+	struct serial_replay *sr;
+
+	sr = malloc(sizeof *sr);
+	if (sr == NULL)
+		return (NULL);
+
+	sr->sr_transcript = st;
+	sr->sr_record = 0;
+	sr->sr_offset = 0;
+	sr->sr_compress = compress;
+	sr->sr_failed = false;
+	return (sr);
+}
+
+void
+serial_replay_free(struct serial_replay *sr)
+{
+	free(sr);
+}
+
+bool
+serial_replay_finished(struct serial_replay *sr)
+{
+	return (!sr->sr_failed &&
+		sr->sr_record == sr->sr_transcript->st_count);
+}
+
+int
+serial_replay_read(struct serial_replay *sr, char *buf, size_t len)
+{
+	const struct serial_transcript_record *str;
+	size_t chunk;
+
+	while (len != 0) {
+		if (sr->sr_failed)
+			return (EPROTO);
+
+		/*
+		 * If the device had nothing more to say at this point, it did
+		 * not answer, which is a timeout rather than a mismatch: a
+		 * probe at the wrong rate is recorded just like that, and the
+		 * session carries on with whatever we send next.
+		 */
+		if (sr->sr_record == sr->sr_transcript->st_count)
+			return (ETIMEDOUT);
+		str = &sr->sr_transcript->st_records[sr->sr_record];
+		if (str->str_direction != SERIAL_TRANSCRIPT_RECEIVED)
+			return (ETIMEDOUT);
+
+		if (sr->sr_offset == 0)
+			serial_replay_delay(sr, str->str_delay);
+
+		chunk = str->str_len - sr->sr_offset;
+		if (chunk > len)
+			chunk = len;
+		memcpy(buf, sr->sr_transcript->st_data + str->str_offset +
+		       sr->sr_offset, chunk);
+		buf += chunk;
+		len -= chunk;
+
+		sr->sr_offset += chunk;
+		if (sr->sr_offset == str->str_len) {
+			sr->sr_record++;
+			sr->sr_offset = 0;
+		}
+	}
+	return (0);
+}
+
+int
+serial_replay_write(struct serial_replay *sr, const char *buf, size_t len)
+{
+	const struct serial_transcript_record *str;
+	size_t chunk;
+
+	while (len != 0) {
+		if (sr->sr_failed)
+			return (EPROTO);
+
+		/*
+		 * Anything we send must be exactly what was sent when the
+		 * transcript was recorded, and must be sent when the device
+		 * was listening rather than talking.
+		 */
+		if (sr->sr_record == sr->sr_transcript->st_count) {
+			sr->sr_failed = true;
+			return (EPROTO);
+		}
+		str = &sr->sr_transcript->st_records[sr->sr_record];
+		if (str->str_direction != SERIAL_TRANSCRIPT_SENT) {
+			sr->sr_failed = true;
+			return (EPROTO);
+		}
+
+		chunk = str->str_len - sr->sr_offset;
+		if (chunk > len)
+			chunk = len;
+		if (memcmp(buf, sr->sr_transcript->st_data + str->str_offset +
+			   sr->sr_offset, chunk) != 0) {
+			sr->sr_failed = true;
+			return (EPROTO);
+		}
+		buf += chunk;
+		len -= chunk;
+
+		sr->sr_offset += chunk;
+		if (sr->sr_offset == str->str_len) {
+			sr->sr_record++;
+			sr->sr_offset = 0;
+		}
+	}
+	return (0);
+}
+
+void
+serial_replay_delay(struct serial_replay *sr, unsigned long usec)
+{
+	struct timespec ts;
+
+	if (sr->sr_compress || usec == 0)
+		return;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		continue;
+}
+
+struct serial_recorder *
+serial_recorder_create(const char *path)
+{
+	struct serial_recorder *srec;
+
+	srec = malloc(sizeof *srec);
+	if (srec == NULL)
+		return (NULL);
+
+	srec->srec_file = fopen(path, "w");
+	if (srec->srec_file == NULL) {
+		free(srec);
+		return (NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &srec->srec_last);
+	return (srec);
+}
+
+void
+serial_recorder_free(struct serial_recorder *srec)
+{
+	fclose(srec->srec_file);
+	free(srec);
+}
+
+void
+serial_recorder_received(struct serial_recorder *srec, const char *buf, size_t len)
+{
+	char prefix[32];
+
+	snprintf(prefix, sizeof prefix, "%c %lu", SERIAL_TRANSCRIPT_RECEIVED,
+		 serial_recorder_elapsed(srec));
+	serial_recorder_log(srec, prefix, buf, len);
+}
+
+void
+serial_recorder_sent(struct serial_recorder *srec, const char *buf, size_t len)
+{
+	char prefix[2];
+
+	(void)serial_recorder_elapsed(srec);
+	prefix[0] = SERIAL_TRANSCRIPT_SENT;
+	prefix[1] = '\0';
+	serial_recorder_log(srec, prefix, buf, len);
+}
+
+static unsigned long
+serial_recorder_elapsed(struct serial_recorder *srec)
+{
+	struct timespec now;
+	unsigned long usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - srec->srec_last.tv_sec) * 1000000 +
+	    (now.tv_nsec - srec->srec_last.tv_nsec) / 1000;
+	srec->srec_last = now;
+	return (usec);
+}
+
+static void
+serial_recorder_log(struct serial_recorder *srec, const char *prefix, const char *buf, size_t len)
+{
+	size_t i;
+
+	fputs(prefix, srec->srec_file);
+	for (i = 0; i < len; i++)
+		fprintf(srec->srec_file, " %02x", (unsigned char)buf[i]);
+	fputc('\n', srec->srec_file);
+	fflush(srec->srec_file);
+}
+
+/*
+ * Parse one line of a transcript.  With no transcript, just count the records
+ * and bytes it would add.
+ */
+static bool
+serial_transcript_parse(struct serial_transcript *st, char *line, size_t *records, size_t *data)
+{
+	struct serial_transcript_record *str;
+	unsigned long delay, byte;
+	char direction;
+	size_t len;
+	char *p, *end;
+
+	for (p = line; isspace((unsigned char)*p); p++)
+		continue;
+	if (*p == '\0' || *p == '#')
+		return (true);
+
+	direction = *p++;
+	delay = 0;
+	switch (direction) {
+	case SERIAL_TRANSCRIPT_SENT:
+		break;
+	case SERIAL_TRANSCRIPT_RECEIVED:
+		delay = strtoul(p, &end, 10);
+		if (end == p)
+			return (false);
+		p = end;
+		break;
+	default:
+		return (false);
+	}
+
+	len = 0;
+	for (;;) {
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == '\0')
+			break;
+		byte = strtoul(p, &end, 16);
+		if (end == p || byte > 0xff)
+			return (false);
+		p = end;
+		if (st != NULL)
+			st->st_data[*data + len] = byte;
+		len++;
+	}
+	if (len == 0)
+		return (false);
+
+	if (st != NULL) {
+		str = &st->st_records[*records];
+		str->str_direction = direction;
+		str->str_delay = delay;
+		str->str_offset = *data;
+		str->str_len = len;
+	}
+	(*records)++;
+	*data += len;
+	return (true);
+}
+
+/*
+ * A line too long for the buffer comes back from fgets in pieces, each of
+ * which might parse as a record of its own.  Refuse it instead.
+ */
+static bool
+serial_transcript_whole(FILE *file, const char *line)
+{
+	return (strchr(line, '\n') != NULL || feof(file));
+}
@@ -0,0 +1,23 @@
+#ifndef	SERIAL_REPLAY_H
+#define	SERIAL_REPLAY_H
+
+struct serial_recorder;
+struct serial_replay;
+struct serial_transcript;
+
+struct serial_transcript *serial_transcript_load(const char *);
+void serial_transcript_free(struct serial_transcript *);
+
+struct serial_replay *serial_replay_create(const struct serial_transcript *, bool);
+void serial_replay_free(struct serial_replay *);
+bool serial_replay_finished(struct serial_replay *);
+int serial_replay_read(struct serial_replay *, char *, size_t);
+int serial_replay_write(struct serial_replay *, const char *, size_t);
+void serial_replay_delay(struct serial_replay *, unsigned long);
+
+struct serial_recorder *serial_recorder_create(const char *);
+void serial_recorder_free(struct serial_recorder *);
+void serial_recorder_received(struct serial_recorder *, const char *, size_t);
+void serial_recorder_sent(struct serial_recorder *, const char *, size_t);
+
+#endif /* !SERIAL_REPLAY_H */
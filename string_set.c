@@ -1,20 +1,36 @@
 #include <sys/types.h>
-#include <sys/queue.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "string_set.h"
 
-struct string_set_item;
+/*
+ * All strings live back to back in a single arena, with an array of offsets
+ * into it for indexed access and an open-addressed table of indices for
+ * finding duplicates.  Adding a string is at most an amortized reallocation,
+ * and freeing the set is the same handful of calls however big it is.
+ *
+ * Because the arena may move as it grows, a string returned by
+ * string_set_get is only good until the next string_set_add.
+ */
+
+#define	STRING_SET_MIN_ARENA	(256)
+#define	STRING_SET_MIN_ITEMS	(16)
 
 struct string_set {
-	STAILQ_HEAD(, string_set_item) ss_items;
+	char *ss_arena;
+	size_t ss_arena_len;
+	size_t ss_arena_size;
+	size_t *ss_offsets;
+	size_t ss_count;
+	size_t *ss_table;
+	size_t ss_table_size;
 };
 
-struct string_set_item {
-	char *ssi_string;
-	STAILQ_ENTRY(string_set_item) ssi_link;
-};
+static size_t string_set_hash(const char *, size_t);
+static void string_set_rehash(struct string_set *);
+static size_t *string_set_slot(struct string_set *, const char *, size_t);
 
 struct string_set *
 string_set_create(void)
@@ -25,61 +41,147 @@ string_set_create(void)
 	if (ss == NULL)
 		return (NULL);
 
-	STAILQ_INIT(&ss->ss_items);
+	ss->ss_arena_len = 0;
+	ss->ss_arena_size = STRING_SET_MIN_ARENA;
+	ss->ss_count = 0;
+	ss->ss_table_size = STRING_SET_MIN_ITEMS * 2;
+
+	ss->ss_arena = malloc(ss->ss_arena_size);
+	ss->ss_offsets = malloc(STRING_SET_MIN_ITEMS * sizeof ss->ss_offsets[0]);
+	ss->ss_table = calloc(ss->ss_table_size, sizeof ss->ss_table[0]);
+	if (ss->ss_arena == NULL || ss->ss_offsets == NULL ||
+	    ss->ss_table == NULL) {
+		string_set_free(ss);
+		return (NULL);
+	}
+
 	return (ss);
 }
 
 void
 string_set_free(struct string_set *ss)
 {
-	struct string_set_item *ssi, *next;
-
-#ifdef	STAILQ_FOREACH_SAFE
-	STAILQ_FOREACH_SAFE(ssi, &ss->ss_items, ssi_link, next) {
-#else
-	ssi = STAILQ_FIRST(&ss->ss_items); 
-	while (ssi != NULL) {
-		next = STAILQ_NEXT(ssi, ssi_link);
-#endif
-		STAILQ_REMOVE(&ss->ss_items, ssi, string_set_item, ssi_link);
-
-		free(ssi->ssi_string);
-		free(ssi);
-#ifndef	STAILQ_FOREACH_SAFE
-		ssi = next;
-#endif
-	}
+	free(ss->ss_arena);
+	free(ss->ss_offsets);
+	free(ss->ss_table);
 	free(ss);
 }
 
-void
+bool
 string_set_add(struct string_set *ss, const char *src)
 {
-	struct string_set_item *ssi;
-	char *string;
+	size_t *slot;
+	size_t len;
 
-	ssi = malloc(sizeof *ssi);
-	if (ssi == NULL)
-		abort();
+	len = strlen(src);
 
-	string = strdup(src);
-	if (string == NULL)
-		abort();
+	slot = string_set_slot(ss, src, len);
+	if (*slot != 0)
+		return (false);
 
-	ssi->ssi_string = string;
-	STAILQ_INSERT_TAIL(&ss->ss_items, ssi, ssi_link);
+	if (ss->ss_arena_len + len + 1 > ss->ss_arena_size) {
+		while (ss->ss_arena_len + len + 1 > ss->ss_arena_size)
+			ss->ss_arena_size *= 2;
+		ss->ss_arena = realloc(ss->ss_arena, ss->ss_arena_size);
+		if (ss->ss_arena == NULL)
+			abort();
+	}
+
+	/*
+	 * The offsets array is always half the size of the table, which is
+	 * kept no more than half full.
+	 */
+	if (ss->ss_count == ss->ss_table_size / 2) {
+		ss->ss_offsets = realloc(ss->ss_offsets,
+					 ss->ss_table_size * sizeof ss->ss_offsets[0]);
+		if (ss->ss_offsets == NULL)
+			abort();
+		string_set_rehash(ss);
+		slot = string_set_slot(ss, src, len);
+	}
+
+	memcpy(ss->ss_arena + ss->ss_arena_len, src, len + 1);
+	ss->ss_offsets[ss->ss_count] = ss->ss_arena_len;
+	ss->ss_arena_len += len + 1;
+
+	/*
+	 * Table entries are indices plus one, so that zero means empty.
+	 */
+	*slot = ++ss->ss_count;
+	return (true);
+}
+
+size_t
+string_set_count(struct string_set *ss)
+{
+	return (ss->ss_count);
+}
+
+const char *
+string_set_get(struct string_set *ss, size_t i)
+{
+	if (i >= ss->ss_count)
+		return (NULL);
+	return (ss->ss_arena + ss->ss_offsets[i]);
 }
 
 void
 string_set_foreach(struct string_set *ss, string_set_iterator_t *iter, void *a)
 {
-	struct string_set_item *ssi;
-
-#ifdef	STAILQ_FOREACH
-	STAILQ_FOREACH(ssi, &ss->ss_items, ssi_link) {
-#else
-	for (ssi = STAILQ_FIRST(&ss->ss_items); ssi != NULL; ssi = STAILQ_NEXT(ssi, ssi_link)) {
-#endif
-		iter(a, ssi->ssi_string);
+	size_t i;
+
+	for (i = 0; i < ss->ss_count; i++)
+		iter(a, ss->ss_arena + ss->ss_offsets[i]);
+}
+
+static size_t
+string_set_hash(const char *string, size_t len)
+{
+	size_t hash;
+
+	/*
+	 * FNV-1a.
+	 */
+	hash = 2166136261u;
+	while (len-- != 0) {
+		hash ^= (unsigned char)*string++;
+		hash *= 16777619u;
+	}
+	return (hash);
+}
+
+static void
+string_set_rehash(struct string_set *ss)
+{
+	const char *string;
+	size_t *slot;
+	size_t i;
+
+	free(ss->ss_table);
+	ss->ss_table_size *= 2;
+	ss->ss_table = calloc(ss->ss_table_size, sizeof ss->ss_table[0]);
+	if (ss->ss_table == NULL)
+		abort();
+
+	for (i = 0; i < ss->ss_count; i++) {
+		string = ss->ss_arena + ss->ss_offsets[i];
+		slot = string_set_slot(ss, string, strlen(string));
+		*slot = i + 1;
+	}
+}
+
+static size_t *
+string_set_slot(struct string_set *ss, const char *string, size_t len)
+{
+	size_t *slot;
+	size_t i;
+
+	for (i = string_set_hash(string, len) & (ss->ss_table_size - 1);;
+	     i = (i + 1) & (ss->ss_table_size - 1)) {
+		slot = &ss->ss_table[i];
+		if (*slot == 0)
+			return (slot);
+		if (strcmp(ss->ss_arena + ss->ss_offsets[*slot - 1], string) == 0)
+			return (slot);
 	}
 }
@@ -8,7 +8,9 @@ typedef	void string_set_iterator_t(void *, const char *);
 struct string_set *string_set_create(void);
 void string_set_free(struct string_set *);
 
-void string_set_add(struct string_set *, const char *);
+bool string_set_add(struct string_set *, const char *);
+size_t string_set_count(struct string_set *);
+const char *string_set_get(struct string_set *, size_t);
 void string_set_foreach(struct string_set *, string_set_iterator_t *, void *);
 
 #endif /* !STRING_SET_H */